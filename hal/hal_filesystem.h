@@ -21,5 +21,37 @@ int32_t hal_fclose(FILE* pFile);
 int32_t hal_fseek(FILE* pFile, int startPos);
 size_t hal_fread(FILE* pFile, void* dst, size_t numBytes);
 int32_t hal_ftell(FILE* pFile);
+uint32_t hal_fsize(FILE* pFile);
+
+// ---- writing ----
+// Creates the file (or truncates an existing one) for reading and writing. Returns 1 on success or 0 on error.
+int32_t hal_fcreate(FILE** pFile, const char* pFileName);
+size_t hal_fwrite(FILE* pFile, const void* src, size_t numBytes);
+// Opens a temporary file for reading and writing, which is removed by hal_ftmpclose(). Returns 1 on success.
+int32_t hal_ftmpopen(FILE** pFile);
+int32_t hal_ftmpclose(FILE* pFile);
+
+// ---- optional memory mapping ----
+// Maps the whole file read only. Backends without mapping support return false, the reader then uses the
+// cached hal_fread() path.
+bool hal_fmap(FILE* pFile, const uint8_t** ppData, uint32_t* pSize);
+void hal_funmap(const uint8_t* pData, uint32_t size);
+
+// ---- optional background reading ----
+// A read request, which is processed by a background thread. The request must stay valid until it is done.
+typedef struct {
+  FILE* pFile;
+  int32_t startPos;
+  void* dst;
+  size_t numBytes;
+  size_t result;          // number of bytes read, valid when done
+  volatile bool bDone;
+} HAL_ASYNC_READ;
+
+// Queues a read request. Backends without threads return false, the reader then uses hal_fread().
+// Background reads don't move the file position of pFile.
+bool hal_freadAsync(HAL_ASYNC_READ* pRequest);
+// Blocks until the request is done and returns the number of bytes read.
+size_t hal_freadWait(HAL_ASYNC_READ* pRequest);
 
 #endif
\ No newline at end of file
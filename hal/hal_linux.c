@@ -0,0 +1,235 @@
+//////////////////////////////////////////////////////////////
+// Hardware abstraction layer for Linux / POSIX systems.    //
+// Files are read with stdio, and mapped with mmap() if     //
+// possible, so the reader can skip the cache completely.  //
+//////////////////////////////////////////////////////////////
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hal_filesystem.h"
+#include "hal_misc.h"
+
+// ---- Finding functions ----
+static DIR* g_findDir = NULL;
+
+bool hal_findNext(FO_FIND_DATA* findData) {
+  struct dirent* pEntry;
+
+  if (!g_findDir)
+    return false;
+
+  while ((pEntry = readdir(g_findDir)) != NULL) {
+    if (pEntry->d_name[0] == '.')
+      continue;
+
+    strncpy(findData->fileName, pEntry->d_name, sizeof(findData->fileName) - 1);
+    findData->fileName[sizeof(findData->fileName) - 1] = '\0';
+    return true;
+  }
+
+  return false;
+}
+
+bool hal_findInit(char* path, FO_FIND_DATA* findData) {
+  hal_findFree();
+  g_findDir = opendir(path);
+  return hal_findNext(findData);
+}
+
+void hal_findFree() {
+  if (g_findDir)
+    closedir(g_findDir);
+  g_findDir = NULL;
+}
+
+// ---- Filesystem functions ----
+
+// Returns 1, if file was opened successfully or 0 on error.
+int32_t hal_fopen(FILE** pFile, const char* pFileName) {
+  *pFile = fopen(pFileName, "rb");
+  return *pFile != NULL;
+}
+
+int32_t hal_fclose(FILE* pFile) {
+  return fclose(pFile) == 0;
+}
+
+int32_t hal_fseek(FILE* pFile, int startPos) {
+  return fseek(pFile, startPos, SEEK_SET);
+}
+
+size_t hal_fread(FILE* pFile, void* dst, size_t numBytes) {
+  return fread(dst, 1, numBytes, pFile);
+}
+
+int32_t hal_ftell(FILE* pFile) {
+  return ftell(pFile);
+}
+
+uint32_t hal_fsize(FILE* pFile) {
+  struct stat st;
+  return fstat(fileno(pFile), &st) == 0 && st.st_size > 0 && st.st_size <= UINT32_MAX ? (uint32_t)st.st_size : 0;
+}
+
+int32_t hal_fcreate(FILE** pFile, const char* pFileName) {
+  *pFile = fopen(pFileName, "wb+");
+  return *pFile != NULL;
+}
+
+size_t hal_fwrite(FILE* pFile, const void* src, size_t numBytes) {
+  return fwrite(src, 1, numBytes, pFile);
+}
+
+// tmpfile() is removed by the system when it's closed
+int32_t hal_ftmpopen(FILE** pFile) {
+  *pFile = tmpfile();
+  return *pFile != NULL;
+}
+
+int32_t hal_ftmpclose(FILE* pFile) {
+  return fclose(pFile) == 0;
+}
+
+bool hal_fmap(FILE* pFile, const uint8_t** ppData, uint32_t* pSize) {
+  struct stat st;
+  void* pMapped;
+
+  if (fstat(fileno(pFile), &st) != 0 || st.st_size <= 0 || st.st_size > UINT32_MAX)
+    return false;
+
+  pMapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(pFile), 0);
+  if (pMapped == MAP_FAILED)
+    return false;
+
+  madvise(pMapped, st.st_size, MADV_WILLNEED); // SMF tracks are read front to back, let the kernel read ahead
+  *ppData = pMapped;
+  *pSize = (uint32_t)st.st_size;
+  return true;
+}
+
+void hal_funmap(const uint8_t* pData, uint32_t size) {
+  munmap((void*)pData, size);
+}
+
+// A single worker thread serves all background reads in the order they were queued. pread() is used, so the
+// file position of the foreground reads is not disturbed.
+#define HAL_ASYNC_QUEUE_SIZE 64
+
+static pthread_mutex_t asyncMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t asyncQueued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t asyncDone = PTHREAD_COND_INITIALIZER;
+static HAL_ASYNC_READ* asyncQueue[HAL_ASYNC_QUEUE_SIZE];
+static uint32_t asyncHead, asyncTail;
+static bool asyncWorkerStarted;
+
+static void* hal_asyncWorker(void* pArg) {
+  for (;;) {
+    HAL_ASYNC_READ* pRequest;
+    ssize_t result;
+
+    pthread_mutex_lock(&asyncMutex);
+    while (asyncHead == asyncTail)
+      pthread_cond_wait(&asyncQueued, &asyncMutex);
+    pRequest = asyncQueue[asyncTail % HAL_ASYNC_QUEUE_SIZE];
+    pthread_mutex_unlock(&asyncMutex);
+
+    result = pread(fileno(pRequest->pFile), pRequest->dst, pRequest->numBytes, pRequest->startPos);
+
+    pthread_mutex_lock(&asyncMutex);
+    pRequest->result = result > 0 ? (size_t)result : 0;
+    pRequest->bDone = true;
+    asyncTail++;
+    pthread_cond_broadcast(&asyncDone);
+    pthread_mutex_unlock(&asyncMutex);
+  }
+
+  return NULL;
+}
+
+bool hal_freadAsync(HAL_ASYNC_READ* pRequest) {
+  bool bQueued = false;
+
+  pthread_mutex_lock(&asyncMutex);
+  if (!asyncWorkerStarted) {
+    pthread_t thread;
+    asyncWorkerStarted = pthread_create(&thread, NULL, hal_asyncWorker, NULL) == 0;
+    if (asyncWorkerStarted)
+      pthread_detach(thread);
+  }
+
+  if (asyncWorkerStarted && asyncHead - asyncTail < HAL_ASYNC_QUEUE_SIZE) {
+    pRequest->result = 0;
+    pRequest->bDone = false;
+    asyncQueue[asyncHead++ % HAL_ASYNC_QUEUE_SIZE] = pRequest;
+    pthread_cond_signal(&asyncQueued);
+    bQueued = true;
+  }
+  pthread_mutex_unlock(&asyncMutex);
+
+  return bQueued;
+}
+
+size_t hal_freadWait(HAL_ASYNC_READ* pRequest) {
+  pthread_mutex_lock(&asyncMutex);
+  while (!pRequest->bDone)
+    pthread_cond_wait(&asyncDone, &asyncMutex);
+  pthread_mutex_unlock(&asyncMutex);
+
+  return pRequest->result;
+}
+
+// ---- Misc functions ----
+
+uint32_t hal_clock() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+uint32_t hal_clockUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)(ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static void hal_vprintfColored(const char* color, const char* format, va_list args) {
+  printf("%s", color);
+  vprintf(format, args);
+  printf("\x1b[0m\r\n");
+}
+
+void hal_printfError(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  hal_vprintfColored("\x1b[31m", format, args);
+  va_end(args);
+}
+
+void hal_printfWarning(char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  hal_vprintfColored("\x1b[33m", format, args);
+  va_end(args);
+}
+
+void hal_printfSuccess(char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  hal_vprintfColored("\x1b[32m", format, args);
+  va_end(args);
+}
+
+void hal_printfInfo(char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  hal_vprintfColored("\x1b[0m", format, args);
+  va_end(args);
+}
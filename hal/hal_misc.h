@@ -3,8 +3,9 @@
 
 #include <stdint.h>
 
-// Timing function
-uint32_t hal_clock();
+// Timing functions
+uint32_t hal_clock();   // milliseconds
+uint32_t hal_clockUs(); // microseconds, wraps around after about 71 minutes
 
 // Colored debugging print functions
 void hal_printfError(const char* format, ...);
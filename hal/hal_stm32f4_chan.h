@@ -30,6 +30,48 @@ long hal_ftell(FIL* pFile) {
   return f_tell(pFile);
 }
 
+uint32_t hal_fsize(FIL* pFile) {
+  return f_size(pFile);
+}
+
+int hal_fcreate(FIL* pFile, const char* pFileName) {
+  return f_open(pFile, pFileName, FA_READ | FA_WRITE | FA_CREATE_ALWAYS);
+}
+
+size_t hal_fwrite(FIL* pFile, const void* src, size_t numBytes) {
+  UINT bytesWritten;
+  f_write(pFile, src, numBytes, &bytesWritten);
+  return bytesWritten;
+}
+
+// FatFs has no anonymous files, so only one temporary file may be open at a time
+#define HAL_TMP_FILE_NAME "midi.tmp"
+
+int hal_ftmpopen(FIL* pFile) {
+  return f_open(pFile, HAL_TMP_FILE_NAME, FA_READ | FA_WRITE | FA_CREATE_ALWAYS);
+}
+
+int hal_ftmpclose(FIL* pFile) {
+  int result = f_close(pFile);
+  f_unlink(HAL_TMP_FILE_NAME);
+  return result;
+}
+
+bool hal_fmap(FIL* pFile, const uint8_t** ppData, uint32_t* pSize) {
+  return false; // FatFs can't map files, use the cache
+}
+
+void hal_funmap(const uint8_t* pData, uint32_t size) {
+}
+
+bool hal_freadAsync(HAL_ASYNC_READ* pRequest) {
+  return false; // no threads, read synchronously
+}
+
+size_t hal_freadWait(HAL_ASYNC_READ* pRequest) {
+  return pRequest->result;
+}
+
 char* strcpy_s(char* pDst, int szDst, const char* pSrc) {
   return strcpy(pDst, pSrc); // not secure, but works for now. :)
 }
@@ -37,85 +37,449 @@
 #include "hal/hal_misc.h"
 #include "midifile.h"
 
+/*
+** Internal Functions
+*/
+#define DT_DEF				32			/* assume maximum delta-time + msg is no more than 32 bytes */
+#define SWAP_WORD(w)		(uint16_t)(((w)>>8)|((w)<<8))
+#define SWAP_DWORD(d)		(uint32_t)((d)>>24)|(((d)>>8)&0xff00)|(((d)<<8)&0xff0000)|(((d)<<24))
+
+// WTF? What is the reason for this _VAR_CAST macro? Hiding content of _MIDI_FILE from user by casting from MIDI_FILE?
+#define _VAR_CAST				_MIDI_FILE *pMFembedded = (_MIDI_FILE *)_pMFembedded; 
+#define IsFilePtrValid(pMF)		(pMF)
+#define IsTrackValid(_x)		  (_midiValidateTrack(pMFembedded, _x))
+#define IsChannelValid(_x)		((_x)>=1 && (_x)<=16)
+#define IsNoteValid(_x)			  ((_x)>=0 && (_x)<128)
+#define IsMessageValid(_x)		((_x)>=msgNoteOff && (_x)<=msgMetaEvent)
+
+
 // -----------------------------------
 // Global variables and new functions
 // -----------------------------------
-_MIDI_FILE _midiFile; // TODO: let the user define and pass the instance, so it is possible to open multiple MIDI files at once?
+_MIDI_FILE _midiFile; // Instance used by midiFileOpen(). Use midiFileOpenInstance() to open several files at once.
+_MIDI_FILE _midiFileCreated; // Instance used by midiFileCreate(), see midiFileCreateInstance()
+
+// ---- I/O backend on top of the HAL file functions ----
+static uint32_t halIoRead(void* pContext, uint32_t pos, void* dst, uint32_t numBytes) {
+  hal_fseek((FILE*)pContext, pos);
+  return hal_fread((FILE*)pContext, dst, numBytes);
+}
+
+static uint32_t halIoSize(void* pContext) {
+  return hal_fsize((FILE*)pContext);
+}
+
+static bool halIoMap(void* pContext, const uint8_t** ppData, uint32_t* pSize) {
+  return hal_fmap((FILE*)pContext, ppData, pSize);
+}
+
+static void halIoUnmap(void* pContext, const uint8_t* pData, uint32_t size) {
+  hal_funmap(pData, size);
+}
+
+static bool halIoClose(void* pContext) {
+  return hal_fclose((FILE*)pContext);
+}
+
+static uint32_t halIoWrite(void* pContext, uint32_t pos, const void* src, uint32_t numBytes) {
+  hal_fseek((FILE*)pContext, pos);
+  return hal_fwrite((FILE*)pContext, src, numBytes);
+}
+
+static bool halIoTmpClose(void* pContext) {
+  return hal_ftmpclose((FILE*)pContext);
+}
+
+#ifdef MIDI_CACHE_PREFETCH
+static bool halIoReadAsync(void* pContext, HAL_ASYNC_READ* pRequest) {
+  pRequest->pFile = (FILE*)pContext;
+  return hal_freadAsync(pRequest);
+}
 
-// cache (Only for midi 0 files!)
-static uint8_t g_cache[PLAYBACK_CACHE_SIZE];
-static int32_t g_cacheStartPos = 0;
-static int32_t g_cacheEndPos = 0;
-static bool cacheInitialized = false;
+static uint32_t halIoReadWait(void* pContext, HAL_ASYNC_READ* pRequest) {
+  return hal_freadWait(pRequest);
+}
+#endif
+
+// The HAL's background reads (a thread on Linux) are only used in builds with MIDI_CACHE_PREFETCH
+const MIDI_IO midiIoHal = {
+  .read = halIoRead,
+  .size = halIoSize,
+  .map = halIoMap,
+  .unmap = halIoUnmap,
+  .close = halIoClose,
+  .write = halIoWrite,
+#ifdef MIDI_CACHE_PREFETCH
+  .readAsync = halIoReadAsync,
+  .readWait = halIoReadWait,
+#endif
+};
+
+// Temporary file of hal_ftmpopen(), the spill storage of midiFileCreate()
+static const MIDI_IO halIoTmp = {
+  .read = halIoRead,
+  .size = halIoSize,
+  .close = halIoTmpClose,
+  .write = halIoWrite,
+};
+
+static void cacheSetupWindow(MIDI_CACHE_WINDOW* pWindow, uint8_t* pData, uint32_t size, uint32_t regionStart, uint32_t regionEnd) {
+  memset(pWindow, 0, sizeof(MIDI_CACHE_WINDOW));
+  pWindow->pData = pData;
+  pWindow->size = size;
+  pWindow->regionStart = regionStart;
+  pWindow->regionEnd = regionEnd;
+}
+
+// Waits until the background reads into the cache are done, before the cache memory is reused or the file closed
+static void cacheWaitPrefetch(_MIDI_FILE* pMidiFile) {
+  MIDI_CACHE* pCache = &pMidiFile->cache;
+
+  for (int32_t i = 0; i < pCache->numWindows; ++i) {
+    if (pCache->window[i].bPrefetching)
+      pMidiFile->pIo->readWait(pMidiFile->pIoContext, &pCache->window[i].request);
+    pCache->window[i].bPrefetching = false;
+  }
+}
+
+static void cacheReset(_MIDI_FILE* pMidiFile) {
+  MIDI_CACHE* pCache = &pMidiFile->cache;
+
+  cacheWaitPrefetch(pMidiFile);
+
+  // One window over the whole file, used while the header is parsed and in single window mode
+  cacheSetupWindow(&pCache->window[0], pCache->pBuffer, pCache->size, 0, UINT32_MAX);
+  pCache->numWindows = 1;
+  pCache->lastWindow = 0;
+}
+
+static void cachePartition(MIDI_CACHE* pCache, const _MIDI_FILE* pMidiFile) {
+  int32_t numTracks = pMidiFile->Header.iNumTracks < MAX_MIDI_TRACKS ? pMidiFile->Header.iNumTracks : MAX_MIDI_TRACKS;
+  uint32_t windowSize;
+  uint32_t minWindowSize = PLAYBACK_CACHE_MIN_WINDOW;
+
+  windowSize = numTracks > 1 ? pCache->size / numTracks : 0;
+  if (pCache->mode == cacheSectorAligned) {
+    windowSize &= ~(MIDI_CACHE_SECTOR_SIZE - 1);
+    minWindowSize = MIDI_CACHE_SECTOR_SIZE;
+    if (pCache->size >= MIDI_CACHE_SECTOR_SIZE)
+      pCache->window[0].size = pCache->size & ~(MIDI_CACHE_SECTOR_SIZE - 1);
+  }
+
+  // stay with a single window, if there is not enough memory to give each track a useful window
+  if (pCache->mode != cacheSingleWindow && pCache->mode != cacheMapped && windowSize >= minWindowSize) {
+    for (int iTrack = 0; iTrack < numTracks; ++iTrack)
+      cacheSetupWindow(&pCache->window[iTrack], &pCache->pBuffer[iTrack * windowSize], windowSize,
+        pMidiFile->Track[iTrack].pBaseNew, pMidiFile->Track[iTrack].pEndNew);
+
+    pCache->numWindows = numTracks;
+    pCache->lastWindow = 0;
+  }
+
+  if (pCache->mode == cachePrefetch) {
+    for (int32_t i = 0; i < pCache->numWindows; ++i) {
+      pCache->window[i].size /= 2;
+      pCache->window[i].pNext = pCache->window[i].pData + pCache->window[i].size;
+    }
+  }
+}
+
+static MIDI_CACHE_WINDOW* cacheSelectWindow(MIDI_CACHE* pCache, uint32_t startPos) {
+  MIDI_CACHE_WINDOW* pWindow = &pCache->window[pCache->lastWindow];
+  int32_t lo = 0, hi = pCache->numWindows - 1;
+
+  if (startPos >= pWindow->regionStart && startPos < pWindow->regionEnd)
+    return pWindow;
+
+  // Track chunks are stored in ascending file order, so the window can be found by a binary search.
+  // Positions outside of all tracks (chunk headers) are served by the first window.
+  while (lo <= hi) {
+    int32_t mid = (lo + hi) / 2;
+    if (startPos < pCache->window[mid].regionStart)
+      hi = mid - 1;
+    else if (startPos >= pCache->window[mid].regionEnd)
+      lo = mid + 1;
+    else {
+      pCache->lastWindow = mid;
+      return &pCache->window[mid];
+    }
+  }
+
+  return &pCache->window[0];
+}
+
+static uint32_t readDataToCache(_MIDI_FILE* pMidiFile, MIDI_CACHE_WINDOW* pWindow, uint32_t startPos, uint32_t num) {
+  // For an unknown reason, sometimes after caching, a few bytes earlier are requested, which will result
+  // into another cache miss. To prevent this unnecessary cache miss, a few bytes earlier, from the 
+  // requested starting position will be cached.
+  // TODO: Find out, which access causes this!
+  uint32_t refillStart = startPos > 8 ? startPos - 8 : startPos;
+  uint32_t refillEnd;
+  uint32_t regionEnd = pWindow->regionEnd;
+
+  if (pMidiFile->cache.mode == cacheSectorAligned) {
+    // Whole sectors, unless the requested data wouldn't fit into the window then
+    refillStart = startPos & ~(MIDI_CACHE_SECTOR_SIZE - 1);
+    if (startPos + num > refillStart + pWindow->size)
+      refillStart = startPos;
+    if (regionEnd < UINT32_MAX - MIDI_CACHE_SECTOR_SIZE)
+      regionEnd = (regionEnd + MIDI_CACHE_SECTOR_SIZE - 1) & ~(MIDI_CACHE_SECTOR_SIZE - 1);
+  }
+  else if (refillStart < pWindow->regionStart && startPos >= pWindow->regionStart)
+    refillStart = pWindow->regionStart;
+
+  // Don't read ahead into data of other tracks, their windows will fetch it anyway
+  refillEnd = regionEnd > startPos + num ? regionEnd : startPos + num;
+  if (refillEnd - refillStart > pWindow->size)
+    refillEnd = refillStart + pWindow->size;
+  if (refillEnd > pMidiFile->file_sz)
+    refillEnd = pMidiFile->file_sz; // don't ask the backend for data behind the end of the file
+  if (refillStart > refillEnd)
+    refillStart = refillEnd;
+
+  pWindow->startPos = refillStart;
+  pWindow->fill = pMidiFile->pIo->read(pMidiFile->pIoContext, refillStart, pWindow->pData, refillEnd - refillStart);
+
+  // number of bytes available from the requested position
+  return pWindow->fill > startPos - refillStart ? pWindow->fill - (startPos - refillStart) : 0;
+}
 
-// TODO: lay out to external callback handler
-void onCacheMiss(uint32_t reqStartPos, uint32_t reqNumBytes, uint32_t cachePosOnReq, uint32_t cacheSize) {
-  hal_printfWarning("Cache Miss: requested: %d bytes from %d, cache was at %d with a size of %d!",
-    reqNumBytes, reqStartPos, cachePosOnReq, cacheSize);
+// Starts reading the data behind the window into its second buffer. The buffer overlaps the window by a few bytes,
+// so an event crossing the end of the window can be decoded from it as well.
+static void cacheStartPrefetch(_MIDI_FILE* pMidiFile, MIDI_CACHE_WINDOW* pWindow) {
+  uint32_t start = pWindow->startPos + pWindow->fill - MIDI_EVENT_MAX_HEADER_SIZE;
+  uint32_t num = pWindow->size;
+
+  if (pWindow->fill < pWindow->size || start >= pWindow->regionEnd || start >= pMidiFile->file_sz ||
+      !pMidiFile->pIo->readAsync)
+    return; // end of the file or track reached, or the backend reads synchronously only
+  if (pWindow->regionEnd - start < num)
+    num = pWindow->regionEnd - start;
+  if (pMidiFile->file_sz - start < num)
+    num = pMidiFile->file_sz - start;
+
+  pWindow->request.startPos = start;
+  pWindow->request.dst = pWindow->pNext;
+  pWindow->request.numBytes = num;
+  pWindow->bPrefetching = pMidiFile->pIo->readAsync(pMidiFile->pIoContext, &pWindow->request);
 }
 
-bool requestedChunkStartIsInCache(int32_t startPos, int32_t reqSize, int32_t cacheStartPos, int32_t cacheSize) {
-  return startPos >= cacheStartPos && startPos < cacheStartPos + cacheSize;
+// Fills the window with data from startPos on and returns the number of bytes available from there. In prefetch
+// mode, the second buffer holds this data usually already, then the buffers are just swapped.
+static uint32_t cacheFetch(_MIDI_FILE* pMidiFile, MIDI_CACHE_WINDOW* pWindow, uint32_t startPos, uint32_t num) {
+  if (pMidiFile->cache.mode == cachePrefetch) {
+    uint32_t available;
+
+    if (pWindow->bPrefetching) {
+      uint32_t nextStart = pWindow->request.startPos;
+      uint32_t nextFill = pMidiFile->pIo->readWait(pMidiFile->pIoContext, &pWindow->request);
+
+      pWindow->bPrefetching = false;
+      if (startPos >= nextStart && startPos < nextStart + nextFill) {
+        uint8_t* pData = pWindow->pData;
+        pWindow->pData = pWindow->pNext;
+        pWindow->pNext = pData;
+        pWindow->startPos = nextStart;
+        pWindow->fill = nextFill;
+
+        cacheStartPrefetch(pMidiFile, pWindow);
+        return nextFill - (startPos - nextStart);
+      }
+    }
+
+    available = readDataToCache(pMidiFile, pWindow, startPos, num); // jumped, read synchronously
+    cacheStartPrefetch(pMidiFile, pWindow);
+    return available;
+  }
+
+  return readDataToCache(pMidiFile, pWindow, startPos, num);
 }
 
-uint32_t readDataToCache(FILE* pFile, uint8_t* cache, int32_t startPos, int32_t num) {
-  g_cacheStartPos = startPos;
-  cacheInitialized = true;
-  hal_fseek(pFile, startPos); 
-  return hal_fread(pFile, cache, num);
+// Handles a cache miss: refills the window, updates its counters and reports it
+static uint32_t cacheRefill(_MIDI_FILE* pMidiFile, MIDI_CACHE_WINDOW* pWindow, uint32_t startPos, uint32_t num) {
+  MIDI_CACHE* pCache = &pMidiFile->cache;
+  MIDI_CACHE_STATS* pStats = &pWindow->stats;
+  bool bSeek = pWindow->fill && (startPos < pWindow->startPos || startPos > pWindow->startPos + pWindow->fill);
+  uint32_t windowPos = pWindow->startPos, windowSize = pWindow->size;
+  uint32_t startTime, elapsed, available;
+
+  startTime = hal_clockUs();
+  available = cacheFetch(pMidiFile, pWindow, startPos, num);
+  elapsed = hal_clockUs() - startTime;
+
+  pStats->refills++;
+  pStats->seeks += bSeek;
+  pStats->bytesFetched += pWindow->fill;
+  pStats->refillTimeUs += elapsed;
+  if (elapsed > pStats->maxRefillTimeUs)
+    pStats->maxRefillTimeUs = elapsed;
+  pStats->eofReads += !available;
+
+  if (pCache->pOnMissCb)
+    pCache->pOnMissCb(pCache->pOnMissUserData, (int32_t)(pWindow - pCache->window), startPos, num, windowPos, windowSize, available);
+  return available;
 }
 
-uint32_t readChunkFromCache(void* dst, uint8_t* cache, uint32_t cacheStartPos, int32_t startPos, int32_t num) {
+static uint32_t readChunkFromCache(void* dst, const MIDI_CACHE_WINDOW* pWindow, uint32_t startPos, uint32_t num) {
   // This functions reads data from cache and returns the number of bytes read.
   // If the requested chunk is not in cache, 0 will be returned.
-  int32_t startPosInCache = startPos - cacheStartPos;
-  int32_t bytesToRead = num <= PLAYBACK_CACHE_SIZE ? num : PLAYBACK_CACHE_SIZE;
+  uint32_t startPosInCache = startPos - pWindow->startPos;
+  uint32_t bytesToRead;
 
-  if (!cacheInitialized || !requestedChunkStartIsInCache(startPos, num, cacheStartPos, PLAYBACK_CACHE_SIZE))
+  if (startPos < pWindow->startPos || startPosInCache >= pWindow->fill)
     return 0;
 
-  memcpy(dst, &cache[startPos - cacheStartPos], bytesToRead); // requested data is in cache
+  bytesToRead = pWindow->fill - startPosInCache;
+  if (bytesToRead > num)
+    bytesToRead = num;
+
+  memcpy(dst, &pWindow->pData[startPosInCache], bytesToRead); // requested data is in cache
   return bytesToRead;
 }
 
-int32_t readChunkFromFile(FILE* pFile, void* dst, int32_t startPos, size_t num) {
+// The cache mode may be changed at any time, the cached data is discarded. Mapped mode is only available, if
+// the HAL was able to map the file, otherwise a single window is used.
+void midiFileSetCacheMode(MIDI_FILE* _pMFembedded, tMIDI_CACHE_MODE mode) {
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))	return;
+
+  if (mode == cacheMapped && !pMFembedded->pMapped)
+    mode = cacheSingleWindow;
+  if (mode != cacheMapped && !pMFembedded->pIo)
+    return; // opened from memory, there is nothing to cache
+  if (mode == cachePrefetch && (!pMFembedded->pIo->readAsync || !pMFembedded->pIo->readWait))
+    mode = cachePerTrack;
+
+  pMFembedded->cache.mode = mode;
+  cacheReset(pMFembedded);
+  if (!pMFembedded->bOpenForWriting)
+    cachePartition(&pMFembedded->cache, pMFembedded);
+}
+
+// Returns the ratio of requests, which were served from the cache. Pass -1 to get the ratio over all windows.
+float midiFileGetCacheHitRatio(const MIDI_FILE* _pMFembedded, int32_t iTrack) {
+  MIDI_CACHE_STATS stats;
+
+  midiFileGetCacheStats(_pMFembedded, iTrack, &stats);
+  return stats.hits + stats.misses ? (float)stats.hits / (stats.hits + stats.misses) : 0.0f;
+}
+
+// Returns the cache counters of a track's window, or the sum over all windows if iTrack is -1 (the largest values
+// are the maximum then). In single window mode, all requests are counted in window 0. The counters are reset
+// when the file is opened or the cache mode is changed.
+void midiFileGetCacheStats(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_CACHE_STATS* pStats) {
+  _VAR_CAST;
+  memset(pStats, 0, sizeof(MIDI_CACHE_STATS));
+  if (!IsFilePtrValid(pMFembedded))	return;
+
+  for (int32_t i = 0; i < pMFembedded->cache.numWindows; ++i) {
+    const MIDI_CACHE_STATS* pWindowStats = &pMFembedded->cache.window[i].stats;
+    if (iTrack >= 0 && i != iTrack)
+      continue;
+
+    pStats->hits += pWindowStats->hits;
+    pStats->misses += pWindowStats->misses;
+    pStats->refills += pWindowStats->refills;
+    pStats->seeks += pWindowStats->seeks;
+    pStats->bytesFetched += pWindowStats->bytesFetched;
+    pStats->refillTimeUs += pWindowStats->refillTimeUs;
+    pStats->eofReads += pWindowStats->eofReads;
+    if (pWindowStats->largestRequest > pStats->largestRequest)
+      pStats->largestRequest = pWindowStats->largestRequest;
+    if (pWindowStats->maxRefillTimeUs > pStats->maxRefillTimeUs)
+      pStats->maxRefillTimeUs = pWindowStats->maxRefillTimeUs;
+  }
+}
+
+void midiFileResetCacheStats(MIDI_FILE* _pMFembedded) {
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))	return;
+
+  for (int32_t i = 0; i < pMFembedded->cache.numWindows; ++i)
+    memset(&pMFembedded->cache.window[i].stats, 0, sizeof(MIDI_CACHE_STATS));
+}
+
+// Sets a function, which is called on every cache miss (i.e. to log them or reads over the end of the file). Pass NULL to remove it. The callback
+// is kept, when the cache mode is changed, but must be set again after opening another file.
+void midiFileSetCacheMissCallback(MIDI_FILE* _pMFembedded, OnCacheMissCallback_t pOnMissCb, void* pUserData) {
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))	return;
+
+  pMFembedded->cache.pOnMissCb = pOnMissCb;
+  pMFembedded->cache.pOnMissUserData = pUserData;
+}
+
+// Selects the event types (MIDI_FILTER_*), which the reader returns for a track, or for all tracks if iTrack is -1.
+// Other events are skipped while decoding, their delta times still count. Note that the player relies on meta
+// events for tempo changes.
+void midiFileSetEventFilter(MIDI_FILE* _pMFembedded, int32_t iTrack, uint16_t filter) {
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))	return;
+
+  for (int32_t i = 0; i < MAX_MIDI_TRACKS; ++i)
+    if (iTrack < 0 || i == iTrack)
+      pMFembedded->Track[i].eventFilter = filter;
+}
+
+int32_t readChunkFromFile(_MIDI_FILE* pMidiFile, void* dst, int32_t startPos, size_t num) {
+  MIDI_CACHE_WINDOW* pWindow;
   uint32_t bytesReadTotal = 0;
   uint32_t bytesRead = 0;
   uint8_t* dstBytePtr = dst;
+  bool bMissed = false;
 
+  // a mapped file is read in place, there is no window to look up
+  if (pMidiFile->cache.mode == cacheMapped) {
+    if ((uint32_t)startPos >= pMidiFile->file_sz)
+      return 0;
+    if (num > pMidiFile->file_sz - startPos)
+      num = pMidiFile->file_sz - startPos;
+
+    memcpy(dst, &pMidiFile->pMapped[startPos], num);
+    return num;
+  }
+
+  pWindow = cacheSelectWindow(&pMidiFile->cache, startPos);
   while (num) {
-    bytesRead = readChunkFromCache(dstBytePtr, g_cache, g_cacheStartPos, startPos, num);
+    bytesRead = readChunkFromCache(dstBytePtr, pWindow, startPos, num);
     bytesReadTotal += bytesRead;
     startPos += bytesRead;
     dstBytePtr += bytesRead;
     num -= bytesRead;
 
     if (num) {
-      // For an unknown reason, sometimes after caching, a few bytes earlier are requested, which will result
-      // into another cache miss. To prevent this unnecessary cache miss, a few bytes earlier, from the 
-      // requested starting position will be cached.
-      // TODO: Find out, which access causes this!
-      onCacheMiss(startPos, num, g_cacheStartPos, PLAYBACK_CACHE_SIZE);
-      bytesRead = readDataToCache(pFile, g_cache, startPos > 8 ? startPos - 8 : startPos, PLAYBACK_CACHE_SIZE);
-
-      if (bytesRead == 0) // end of file?
-        hal_printfWarning("Warning, tried to read over end of file!\r\n");
+      bMissed = true;
+
+      if (cacheRefill(pMidiFile, pWindow, startPos, num) == 0)
+        break; // end of file, counted in the stats
     }
   }
 
+  if (bMissed)
+    pWindow->stats.misses++;
+  else
+    pWindow->stats.hits++;
+  if (bytesReadTotal > pWindow->stats.largestRequest)
+    pWindow->stats.largestRequest = bytesReadTotal;
+
   return bytesReadTotal;
 }
 
-int32_t readByteFromFile(FILE* pFile, uint8_t* dst, int32_t startPos) {
-  return readChunkFromFile(pFile, dst, startPos, sizeof(uint8_t));
+int32_t readByteFromFile(_MIDI_FILE* pMidiFile, uint8_t* dst, int32_t startPos) {
+  if (pMidiFile->cache.mode == cacheMapped && (uint32_t)startPos < pMidiFile->file_sz) {
+    *dst = pMidiFile->pMapped[startPos];
+    return 1;
+  }
+
+  return readChunkFromFile(pMidiFile, dst, startPos, sizeof(uint8_t));
 }
 
-int32_t readWordFromFile(FILE* pFile, uint16_t* dst, int32_t startPos) {
-  return readChunkFromFile(pFile, dst, startPos, sizeof(uint16_t));
+int32_t readWordFromFile(_MIDI_FILE* pMidiFile, uint16_t* dst, int32_t startPos) {
+  return readChunkFromFile(pMidiFile, dst, startPos, sizeof(uint16_t));
 }
 
-int32_t readDwordFromFile(FILE* pFile, uint32_t* dst, int32_t startPos) {
-  return readChunkFromFile(pFile, dst, startPos, sizeof(uint32_t));
+int32_t readDwordFromFile(_MIDI_FILE* pMidiFile, uint32_t* dst, int32_t startPos) {
+  return readChunkFromFile(pMidiFile, dst, startPos, sizeof(uint32_t));
 }
 
 void setPlaybackTempo(_MIDI_FILE* pMidiFile, int32_t bpm) {
@@ -123,22 +487,6 @@ void setPlaybackTempo(_MIDI_FILE* pMidiFile, int32_t bpm) {
 }
 
 
-/*
-** Internal Functions
-*/
-#define DT_DEF				32			/* assume maximum delta-time + msg is no more than 32 bytes */
-#define SWAP_WORD(w)		(uint16_t)(((w)>>8)|((w)<<8))
-#define SWAP_DWORD(d)		(uint32_t)((d)>>24)|(((d)>>8)&0xff00)|(((d)<<8)&0xff0000)|(((d)<<24))
-
-// WTF? What is the reason for this _VAR_CAST macro? Hiding content of _MIDI_FILE from user by casting from MIDI_FILE?
-#define _VAR_CAST				_MIDI_FILE *pMFembedded = (_MIDI_FILE *)_pMFembedded; 
-#define IsFilePtrValid(pMF)		(pMF)
-#define IsTrackValid(_x)		  (_midiValidateTrack(pMFembedded, _x))
-#define IsChannelValid(_x)		((_x)>=1 && (_x)<=16)
-#define IsNoteValid(_x)			  ((_x)>=0 && (_x)<128)
-#define IsMessageValid(_x)		((_x)>=msgNoteOff && (_x)<=msgMetaEvent)
-
-
 // looks ok!
 static bool _midiValidateTrack(const _MIDI_FILE *pMFembedded, int32_t iTrack) {
   // normal version
@@ -159,412 +507,2005 @@ static bool _midiValidateTrack(const _MIDI_FILE *pMFembedded, int32_t iTrack) {
   return true;
 }
 
-// looks ok!
-MIDI_FILE  *midiFileOpen(const char *pFilename) {
-  FILE* pFileNew = NULL;
+// Reads num bytes from file position pos, returns the number of bytes read. Lets the chunk walkers run on the
+// reader's cache and on the probe buffer.
+typedef uint32_t (*_MIDI_READ_AT)(void* pContext, uint32_t pos, void* dst, uint32_t num);
+
+#define _LE_DWORD(p)		((uint32_t)(p)[0] | ((uint32_t)(p)[1] << 8) | ((uint32_t)(p)[2] << 16) | ((uint32_t)(p)[3] << 24))
+
+// Returns the position behind the chunk at pos with size bytes of data, or UINT32_MAX if the chunk doesn't end
+// within end. The size is checked before it is added, so a corrupt size can't wrap the position around to an
+// earlier chunk: the walk always moves forward and stops at end.
+static uint32_t _midiNextChunk(uint32_t pos, uint32_t size, uint32_t end) {
+  if (pos > end || end - pos < 8 || size > end - pos - 8)
+    return UINT32_MAX;
+  return pos + 8 + size;
+}
+
+// Returns the file position of the MThd chunk: 0 for a standard MIDI file, or the start of the 'data' chunk of a
+// RIFF RMID file (.rmi). So RMID files are read in place, positions stay file positions. UINT32_MAX if there is
+// no MIDI data or the RIFF chunks are broken. fileSize bounds the RIFF chunk.
+static uint32_t _midiFindSmf(_MIDI_READ_AT read, void* pContext, uint32_t fileSize) {
+  uint8_t header[12];
+  uint32_t pos, end;
+
+  if (read(pContext, 0, header, sizeof(header)) != sizeof(header))
+    return UINT32_MAX;
+  if (memcmp(header, "MThd", 4) == 0)
+    return 0;
+  if (memcmp(header, "RIFF", 4) != 0 || memcmp(&header[8], "RMID", 4) != 0)
+    return UINT32_MAX;
+
+  end = _midiNextChunk(0, _LE_DWORD(&header[4]), fileSize);
+  if (end == UINT32_MAX)
+    end = fileSize; // the RIFF size is often wrong, the sub-chunks must still fit into the file
+  for (pos = 12; pos < end && end - pos >= 8; ) {
+    uint8_t chunk[8];
+    uint32_t size;
+
+    if (read(pContext, pos, chunk, sizeof(chunk)) != sizeof(chunk))
+      break;
+    size = _LE_DWORD(&chunk[4]);
+    if (memcmp(chunk, "data", 4) == 0)
+      return pos + 8;
+    if ((pos = _midiNextChunk(pos, size, end)) == UINT32_MAX)
+      break;
+    pos += size & 1; // RIFF chunks are padded to an even size
+  }
+
+  return UINT32_MAX;
+}
+
+static uint32_t _midiFileReadAt(void* pContext, uint32_t pos, void* dst, uint32_t num) {
+  return readChunkFromFile((_MIDI_FILE*)pContext, dst, pos, num);
+}
+
+// Parses the header and the track table. The source (file or memory) must already be set up in pMidiFile.
+static bool _midiFileReadHeader(_MIDI_FILE *pMidiFile) {
   uint32_t ptrNew;
-  bool bValidFile = false;
-  cacheInitialized = false; // invalidate cache
 
-  if(!hal_fopen(&pFileNew, pFilename))
-    return NULL;
+  /* Is this a valid MIDI file ? */
+  ptrNew = _midiFindSmf(_midiFileReadAt, pMidiFile, pMidiFile->file_sz);
 
-  if (pFileNew) {
-    /* Is this a valid MIDI file ? */
-    ptrNew = 0;
-    char magic[5];
-    readChunkFromFile(pFileNew, magic, ptrNew, 4);
-    magic[4] = '\0';
-
-    if (strcmp(magic, "MThd") == 0) {
-      uint32_t dwDataNew;
-      uint16_t wDataNew;
-
-      readDwordFromFile(pFileNew, &dwDataNew, 4);
-      _midiFile.Header.iHeaderSize = SWAP_DWORD(dwDataNew);
-
-      readWordFromFile(pFileNew, &wDataNew, 8);
-      _midiFile.Header.iVersion = (uint16_t)SWAP_WORD(wDataNew);
-          
-      readWordFromFile(pFileNew, &wDataNew, 10);
-      _midiFile.Header.iNumTracks = (uint16_t)SWAP_WORD(wDataNew);
-
-      readWordFromFile(pFileNew, &wDataNew, 12);
-      _midiFile.Header.PPQN = (uint16_t)SWAP_WORD(wDataNew);
-          
-      ptrNew += _midiFile.Header.iHeaderSize + 8;
-      /*
-      **	 Get all tracks
-      */
-
-      // Init
-      for (int iTrack = 0; iTrack < MAX_MIDI_TRACKS; ++iTrack) {
-        _midiFile.Track[iTrack].pos = 0;
-        _midiFile.Track[iTrack].last_status = 0;
-      }
-          
-      for (int iTrack = 0; iTrack < _midiFile.Header.iNumTracks && iTrack < MAX_MIDI_TRACKS; ++iTrack) {
-        _midiFile.Track[iTrack].pBaseNew = ptrNew;
-
-        readDwordFromFile(pFileNew, &dwDataNew, ptrNew + 4);
-        _midiFile.Track[iTrack].sz = SWAP_DWORD(dwDataNew);
-        _midiFile.Track[iTrack].ptrNew = ptrNew + 8;
-        _midiFile.Track[iTrack].pEndNew = ptrNew + _midiFile.Track[iTrack].sz + 8;
-        ptrNew += _midiFile.Track[iTrack].sz + 8;
-      }
+  if (ptrNew != UINT32_MAX) {
+    uint32_t dwDataNew;
+    uint16_t wDataNew;
+    int iTrack;
+
+    readDwordFromFile(pMidiFile, &dwDataNew, ptrNew + 4);
+    pMidiFile->Header.iHeaderSize = SWAP_DWORD(dwDataNew);
 
-      _midiFile.bOpenForWriting = false;
-      bValidFile = true;
+    readWordFromFile(pMidiFile, &wDataNew, ptrNew + 8);
+    pMidiFile->Header.iVersion = (uint16_t)SWAP_WORD(wDataNew);
+        
+    readWordFromFile(pMidiFile, &wDataNew, ptrNew + 10);
+    pMidiFile->Header.iNumTracks = (uint16_t)SWAP_WORD(wDataNew);
+
+    readWordFromFile(pMidiFile, &wDataNew, ptrNew + 12);
+    pMidiFile->Header.PPQN = (uint16_t)SWAP_WORD(wDataNew);
+        
+    if ((ptrNew = _midiNextChunk(ptrNew, pMidiFile->Header.iHeaderSize, pMidiFile->file_sz)) == UINT32_MAX)
+      return false;
+    /*
+    **	 Get all tracks
+    */
+
+    // Init
+    for (int iTrack = 0; iTrack < MAX_MIDI_TRACKS; ++iTrack) {
+      pMidiFile->Track[iTrack].pos = 0;
+      pMidiFile->Track[iTrack].last_status = 0;
+      pMidiFile->Track[iTrack].eventFilter = MIDI_FILTER_ALL;
     }
+        
+    // Other chunks than MTrk may be mixed in, they are skipped by their length
+    for (iTrack = 0; iTrack < pMidiFile->Header.iNumTracks && iTrack < MAX_MIDI_TRACKS; ) {
+      char chunkId[4];
+      uint32_t size, next;
+
+      if (ptrNew + 8 > pMidiFile->file_sz || readChunkFromFile(pMidiFile, chunkId, ptrNew, 4) != 4)
+        break;
+      readDwordFromFile(pMidiFile, &dwDataNew, ptrNew + 4);
+      size = SWAP_DWORD(dwDataNew);
+
+      next = _midiNextChunk(ptrNew, size, pMidiFile->file_sz);
+      if (memcmp(chunkId, "MTrk", 4) == 0) {
+        pMidiFile->Track[iTrack].pBaseNew = ptrNew;
+        pMidiFile->Track[iTrack].sz = size;
+        pMidiFile->Track[iTrack].ptrNew = ptrNew + 8;
+        pMidiFile->Track[iTrack].pEndNew = next != UINT32_MAX ? next : pMidiFile->file_sz; // a truncated last track
+        iTrack++;
+      }
+      if (next == UINT32_MAX)
+        break;
+      ptrNew = next;
+    }
+    if (iTrack < pMidiFile->Header.iNumTracks && iTrack < MAX_MIDI_TRACKS)
+      pMidiFile->Header.iNumTracks = (uint16_t)iTrack; // the file is truncated
+
+    pMidiFile->bOpenForWriting = false;
+    cachePartition(&pMidiFile->cache, pMidiFile);
+    setPlaybackTempo(pMidiFile, MIDI_BPM_DEFAULT);
+    return true;
   }
-  
-  if (!bValidFile)
+
+  return false;
+}
+
+// Opens a MIDI file into a context owned by the caller. All state, including the cache, lives in pMidiFile, so
+// several files may be opened at once (i.e. one per thread) without any locking.
+MIDI_FILE  *midiFileOpenInstance(_MIDI_FILE *pMidiFile, const char *pFilename) {
+  return midiFileOpenCached(pMidiFile, pFilename, NULL, 0);
+}
+
+// Like midiFileOpenInstance(), but the cache uses the memory pCache of cacheSize bytes (at least
+// PLAYBACK_CACHE_MIN_WINDOW) instead of the built-in buffer. So the cache can be sized per file or per device.
+// The memory must stay valid until the file is closed. Pass NULL to use the built-in buffer.
+MIDI_FILE  *midiFileOpenCached(_MIDI_FILE *pMidiFile, const char *pFilename, void *pCache, uint32_t cacheSize) {
+  FILE* pFileNew = NULL;
+
+  if (!pMidiFile || (pCache && cacheSize < PLAYBACK_CACHE_MIN_WINDOW))
+    return NULL;
+
+  if(!hal_fopen(&pFileNew, pFilename) || !pFileNew)
     return NULL;
- 
-  _midiFile.pFile = pFileNew;
-  setPlaybackTempo(&_midiFile, MIDI_BPM_DEFAULT);
 
-  return (MIDI_FILE *)&_midiFile;  
+  return midiFileOpenIoCached(pMidiFile, &midiIoHal, pFileNew, pCache, cacheSize);
 }
 
-/*
-** midiRead* Functions
-*/
+// Opens a MIDI file from any I/O backend. The backend's close function is called by midiFileClose(), or here if
+// the data is no valid MIDI file. If the backend can map the file, it is read in mapped mode.
+MIDI_FILE  *midiFileOpenIo(_MIDI_FILE *pMidiFile, const MIDI_IO *pIo, void *pContext) {
+  return midiFileOpenIoCached(pMidiFile, pIo, pContext, NULL, 0);
+}
 
-// ok!
-static uint32_t _midiReadVarLen(_MIDI_FILE* pMFembedded, uint32_t* ptrNew, uint32_t* numEmbedded) {
-  uint32_t valueEmbedded; // TODO: uint8_t instead of uint32_t ???
-  uint8_t c;
+MIDI_FILE  *midiFileOpenIoCached(_MIDI_FILE *pMidiFile, const MIDI_IO *pIo, void *pContext, void *pCache, uint32_t cacheSize) {
+  if (!pMidiFile || !pIo || !pIo->read || !pIo->size || (pCache && cacheSize < PLAYBACK_CACHE_MIN_WINDOW))
+    return NULL;
+
+  memset(pMidiFile, 0, sizeof(_MIDI_FILE));
+  pMidiFile->cache.pBuffer = pCache ? (uint8_t*)pCache : pMidiFile->cache.data;
+  pMidiFile->cache.size = pCache ? cacheSize : PLAYBACK_CACHE_SIZE;
+  cacheReset(pMidiFile); // invalidate cache
 
-  // Variable-length values use the lower 7 bits of a byte for data and the top bit to signal a following data byte. 
-  // If the top bit is set to 1 (0x80), then another value byte follows.
-  // A variable - length value may use a maximum of 4 bytes. This means the maximum value that can be represented is 
-  // 0x0FFFFFFF (represented as 0xFF, 0xFF, 0xFF, 0x7F).
+  pMidiFile->pIo = pIo;
+  pMidiFile->pIoContext = pContext;
+  pMidiFile->file_sz = pIo->size(pContext);
+  if (pIo->map && pIo->map(pContext, &pMidiFile->pMapped, &pMidiFile->file_sz))
+    pMidiFile->cache.mode = cacheMapped;
 
-  // TODO: always preload 4 bytes?
-  valueEmbedded = 0;
-  *ptrNew += readChunkFromFile(pMFembedded->pFile, &valueEmbedded, *ptrNew, 1);
-  if (valueEmbedded & 0x80) {
-    valueEmbedded &= 0x7f; // Remove the first bit to extract payload
-    do {
-      *ptrNew += readChunkFromFile(pMFembedded->pFile, &c, *ptrNew, 1);
-      valueEmbedded = (valueEmbedded << 7) + (c & 0x7f);
-    } while (c & 0x80);
+  if (!_midiFileReadHeader(pMidiFile)) {
+    midiFileClose((MIDI_FILE *)pMidiFile);
+    return NULL;
   }
 
-  *numEmbedded = valueEmbedded;
-  return(*ptrNew);
+  return (MIDI_FILE *)pMidiFile;  
 }
 
-// ok!
-static bool _midiReadTrackCopyData(_MIDI_FILE* pMFembedded, MIDI_MSG* pMsgEmbedded, uint32_t ptrEmbedded, size_t* szEmbedded, bool bCopyPtrData) {
-  if (*szEmbedded > META_EVENT_MAX_DATA_SIZE) {
-    printf("\r\n_midiReadTrackCopyData; Warning: Meta data is greater than maximum size! (%d of %d)\r\n", szEmbedded, META_EVENT_MAX_DATA_SIZE);
-    *szEmbedded = META_EVENT_MAX_DATA_SIZE; // truncate meta data, since we don't have enough space
-  }
+// Opens a MIDI file, which is already stored in RAM or in memory mapped flash. No copy of the data is made, so
+// the buffer must stay valid until the file is closed. The data is decoded in place, without the cache.
+MIDI_FILE  *midiFileOpenFromMemory(_MIDI_FILE *pMidiFile, const void *pData, uint32_t size) {
+  if (!pMidiFile || !pData)
+    return NULL;
 
-  if (bCopyPtrData) {
-    readChunkFromFile(pMFembedded->pFile, pMsgEmbedded->dataEmbedded, ptrEmbedded, *szEmbedded);
-    pMsgEmbedded->data_sz_embedded = *szEmbedded;
+  memset(pMidiFile, 0, sizeof(_MIDI_FILE));
+  pMidiFile->cache.pBuffer = pMidiFile->cache.data;
+  pMidiFile->cache.size = PLAYBACK_CACHE_SIZE;
+  cacheReset(pMidiFile);
+
+  pMidiFile->pMapped = (const uint8_t *)pData;
+  pMidiFile->file_sz = size;
+  pMidiFile->cache.mode = cacheMapped;
+
+  if (!_midiFileReadHeader(pMidiFile)) {
+    midiFileClose((MIDI_FILE *)pMidiFile);
+    return NULL;
   }
 
-  return true;
+  return (MIDI_FILE *)pMidiFile;
 }
 
-// ok!
-int32_t midiReadGetNumTracks(const MIDI_FILE *_pMFembedded) {
-  _VAR_CAST;
-  return pMFembedded->Header.iNumTracks <= MAX_MIDI_TRACKS ? pMFembedded->Header.iNumTracks : MAX_MIDI_TRACKS;
+// Opens a MIDI file into the library's global instance. Only one file may be opened this way at a time.
+MIDI_FILE  *midiFileOpen(const char *pFilename) {
+  return midiFileOpenInstance(&_midiFile, pFilename);
 }
 
-// looks ok! (TODO: running status interruption by realtime messages?)
-bool midiReadGetNextMessage(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_MSG* pMsgEmbedded) {
-  MIDI_FILE_TRACK *pTrackNew;
-  uint32_t bptrEmbedded, pMsgDataPtrEmbedded;
-  size_t szEmbedded;
+/*
+** midiFile* write functions
+*/
 
-  _VAR_CAST;
-  if (!IsTrackValid(iTrack))			return false;
-  
-  pTrackNew = &pMFembedded->Track[iTrack];
-  /* FIXME: Check if there is data on this track first!!!	*/
-  if(pTrackNew->ptrNew >= pTrackNew->pEndNew)
-    return false;
-      
-  // Read Delta Time
-  _midiReadVarLen(pMFembedded, &pTrackNew->ptrNew, &pMsgEmbedded->dt);
-  pTrackNew->pos += pMsgEmbedded->dt;
-  pMsgEmbedded->dwAbsPos = pTrackNew->pos;
-
-  bool bRunningStatus = false;
-  uint8_t eventType;
-  readByteFromFile(pMFembedded->pFile, &eventType, pTrackNew->ptrNew);
-
-  if (eventType & 0x80) {	/* Is this a sys message */
-    pMsgEmbedded->iType = (tMIDI_MSG)(eventType & 0xF0);
-    pMsgDataPtrEmbedded = pTrackNew->ptrNew + 1;
-
-    /* SysEx & Meta events don't carry channel info, but something
-    ** important in their lower bits that we must keep */
-    if (pMsgEmbedded->iType == 0xF0)
-      pMsgEmbedded->iType = (tMIDI_MSG)(eventType);
-  }
-  else {  /* just data - so use the last msg type */
-    pMsgEmbedded->iType = pMsgEmbedded->iLastMsgType;
-    pMsgDataPtrEmbedded = pTrackNew->ptrNew;
-    bRunningStatus = true;
-  }
-  pMsgEmbedded->iLastMsgType = (tMIDI_MSG)pMsgEmbedded->iType;
-
-  if (!bRunningStatus)
-    pMsgEmbedded->iLastMsgChnl = (uint8_t)(eventType & 0x0f) + 1;
-  
-  switch (pMsgEmbedded->iType) {
-    // -------------------------
-    // -    Channel Events     -
-    // -------------------------
-    case	msgNoteOff: { // 0x08 'Note Off'
-      uint8_t tmpNote = 0;
-      pMsgEmbedded->MsgData.NoteOff.iChannel = pMsgEmbedded->iLastMsgChnl;
-      readByteFromFile(pMFembedded->pFile, &tmpNote, pMsgDataPtrEmbedded);
-      pMsgEmbedded->MsgData.NoteOff.iNote = tmpNote;
-      pMsgEmbedded->iMsgSize = 3;
-      break;
-    }
+// The writer needs no memory besides the write buffer (the cache memory) and the tracks, however long the song
+// gets. Every used track gets an equal part of the buffer. Its data grows up from the start of the part, its
+// pending notes grow down from the end (pEndNew is the border). When the data reaches the notes, it is appended to
+// the spill storage as a segment. The segments of a track are chained by a header (position of the next segment or
+// 0, size), so the spill storage is written sequentially, apart from the link in the previous segment.
+// midiFileClose() copies the tracks into place.
+#define SPILL_HEADER_SIZE 8
+#define SPILL_NONE UINT32_MAX
+
+// Converts a note length (MIDI_NOTE_*, in ticks of a MIDI_NOTE_CROCHET quarter note) into ticks of the file
+static int32_t _midiGetLength(int32_t PPQN, int32_t iNoteLen, bool bOverride) {
+  return bOverride ? iNoteLen : (int32_t)((int64_t)iNoteLen * PPQN / MIDI_NOTE_CROCHET);
+}
 
-    case	msgNoteOn: { // 0x09 'Note On'
-      uint8_t tmpNote = 0;
-      uint8_t tmpVolume = 0;
-      pMsgEmbedded->MsgData.NoteOn.iChannel = pMsgEmbedded->iLastMsgChnl;
-      readByteFromFile(pMFembedded->pFile, &tmpNote, pMsgDataPtrEmbedded);
-      readByteFromFile(pMFembedded->pFile, &tmpVolume, pMsgDataPtrEmbedded + 1);
-      pMsgEmbedded->MsgData.NoteOn.iNote = tmpNote;
-      pMsgEmbedded->MsgData.NoteOn.iVolume = tmpVolume;
-      pMsgEmbedded->iMsgSize = 3;
-      break;
-    }
-      
-    case	msgNoteKeyPressure: { // 0x0A 'Note Aftertouch'
-      uint8_t tmpNote = 0;
-      uint8_t tmpPressure = 0;
-      pMsgEmbedded->MsgData.NoteKeyPressure.iChannel = pMsgEmbedded->iLastMsgChnl;
-      readByteFromFile(pMFembedded->pFile, &tmpNote, pMsgDataPtrEmbedded);
-      readByteFromFile(pMFembedded->pFile, &tmpPressure, pMsgDataPtrEmbedded + 1);
-      pMsgEmbedded->MsgData.NoteKeyPressure.iNote = tmpNote;
-      pMsgEmbedded->MsgData.NoteKeyPressure.iPressure = tmpPressure;
-      pMsgEmbedded->iMsgSize = 3;
-      break;
-    }
+// The pending notes of a track are a binary min-heap on their end position, so the next note-off is always on top
+// and adding a note costs O(log n). Note i is stored i + 1 notes below the end of the track's part.
+#define _midiWriteNumNotes(pTrack)	(((pTrack)->pBaseNew + (pTrack)->iBlockSize - (pTrack)->pEndNew) / sizeof(MIDI_LAST_NOTE))
 
-    case	msgControlChange: { // // 0x0B 'Controller'
-      uint8_t tmpControl = 0;
-      uint8_t tmpParam = 0;
-      pMsgEmbedded->MsgData.NoteParameter.iChannel = pMsgEmbedded->iLastMsgChnl;
-      readByteFromFile(pMFembedded->pFile, &tmpControl, pMsgDataPtrEmbedded);
-      readByteFromFile(pMFembedded->pFile, &tmpParam, pMsgDataPtrEmbedded + 1);
-      pMsgEmbedded->MsgData.NoteParameter.iControl = tmpControl;
-      pMsgEmbedded->MsgData.NoteParameter.iParam = tmpParam;
-      pMsgEmbedded->iMsgSize = 3;
-      break;
-    }
+static MIDI_LAST_NOTE* _midiWriteNote(_MIDI_FILE* pMidiFile, const MIDI_FILE_TRACK* pTrack, uint32_t i) {
+  return (MIDI_LAST_NOTE*)(pMidiFile->cache.pBuffer + pTrack->pBaseNew + pTrack->iBlockSize) - 1 - i;
+}
 
-    case	msgSetProgram: { // 0x0C 'Program Change'
-      uint8_t tmpProgram = 0;
-      pMsgEmbedded->MsgData.ChangeProgram.iChannel = pMsgEmbedded->iLastMsgChnl;
-      readByteFromFile(pMFembedded->pFile, &tmpProgram, pMsgDataPtrEmbedded);
-      pMsgEmbedded->MsgData.ChangeProgram.iProgram = tmpProgram;
-      pMsgEmbedded->iMsgSize = 2;
-      break;
-    }
+// Adds a note to the heap, the caller makes sure there is room between the data and the notes
+static void _midiWritePushNote(_MIDI_FILE* pMidiFile, MIDI_FILE_TRACK* pTrack, const MIDI_LAST_NOTE* pNote) {
+  uint32_t i = _midiWriteNumNotes(pTrack);
 
-    case	msgChangePressure: { // 0x0D 'Channel Aftertouch'
-      uint8_t tmpPressure = 0;
-      pMsgEmbedded->MsgData.ChangePressure.iChannel = pMsgEmbedded->iLastMsgChnl;
-      readByteFromFile(pMFembedded->pFile, &tmpPressure, pMsgDataPtrEmbedded);
-      pMsgEmbedded->iMsgSize = 2;
-      break;
-    }
+  pTrack->pEndNew -= sizeof(MIDI_LAST_NOTE);
+  while (i > 0) {
+    uint32_t parent = (i - 1) / 2;
 
-    case	msgSetPitchWheel: { // 0x0F 'Pitch Bend'
-      pMsgEmbedded->MsgData.PitchWheel.iChannel = pMsgEmbedded->iLastMsgChnl;
-      uint8_t tmpPitchLow = 0;
-      uint8_t tmpPitchHigh = 0;
-      readByteFromFile(pMFembedded->pFile, &tmpPitchLow, pMsgDataPtrEmbedded);
-      readByteFromFile(pMFembedded->pFile, &tmpPitchHigh, pMsgDataPtrEmbedded + 1);
-      pMsgEmbedded->MsgData.PitchWheel.iPitch = tmpPitchLow | (tmpPitchHigh << 7);
-      pMsgEmbedded->MsgData.PitchWheel.iPitch -= MIDI_WHEEL_CENTRE;
-      pMsgEmbedded->iMsgSize = 3;
+    if (_midiWriteNote(pMidiFile, pTrack, parent)->end_pos <= pNote->end_pos)
       break;
-    }
+    *_midiWriteNote(pMidiFile, pTrack, i) = *_midiWriteNote(pMidiFile, pTrack, parent);
+    i = parent;
+  }
+  *_midiWriteNote(pMidiFile, pTrack, i) = *pNote;
+}
 
-    // -------------------------
-    // -    Meta Events     -
-    // -------------------------
-    case	msgMetaEvent:
-      /* We can use 'pTrack->ptr' from now on, since meta events
-      ** always have bit 7 set */
-
-      // Get Meta Event Type
-      bptrEmbedded = pTrackNew->ptrNew;
-      uint8_t tmpType = 0;
-      readByteFromFile(pMFembedded->pFile, &tmpType, pTrackNew->ptrNew + 1);
-      pMsgEmbedded->MsgData.MetaEvent.iType = tmpType;
-
-      // Get Meta Event Length (TODO: find a 'live' method instead of using a constant sized buffer?)
-      pTrackNew->ptrNew += 2;
-      _midiReadVarLen(pMFembedded, &pTrackNew->ptrNew, &pMsgEmbedded->iMsgSize);
-      szEmbedded = pTrackNew->ptrNew - bptrEmbedded + pMsgEmbedded->iMsgSize;
-
-      if (_midiReadTrackCopyData(pMFembedded, pMsgEmbedded, pTrackNew->ptrNew, &szEmbedded, false) == false)
-        return false;
+// Removes the note on top of the heap
+static void _midiWritePopNote(_MIDI_FILE* pMidiFile, MIDI_FILE_TRACK* pTrack) {
+  uint32_t num = _midiWriteNumNotes(pTrack) - 1, i = 0;
+  MIDI_LAST_NOTE last = *_midiWriteNote(pMidiFile, pTrack, num);
 
-      /* Now copy the data...*/
-      readChunkFromFile(pMFembedded->pFile, pMsgEmbedded->dataEmbedded, bptrEmbedded, szEmbedded);
-
-      /* Place the META data it in a neat structure also for embedded! */
-      switch(pMsgEmbedded->MsgData.MetaEvent.iType) {
-        case	metaSequenceNumber: {
-              uint8_t tmpSequenceNumber;
-              readByteFromFile(pMFembedded->pFile, &tmpSequenceNumber, pTrackNew->ptrNew + 0);
-              pMsgEmbedded->MsgData.MetaEvent.Data.iSequenceNumber = tmpSequenceNumber;
-              break;
-            }
-       
-        case	metaTextEvent:
-        case	metaCopyright:
-        case	metaTrackName:
-        case	metaInstrument:
-        case	metaLyric:
-        case	metaMarker:
-        case	metaCuePoint:
-            pMsgEmbedded->MsgData.MetaEvent.Data.Text.strLen = szEmbedded - 3;
-            pMsgEmbedded->MsgData.MetaEvent.Data.Text.pData = pMsgEmbedded->dataEmbedded + 3;
-            pMsgEmbedded->MsgData.MetaEvent.Data.Text.pData[pMsgEmbedded->MsgData.MetaEvent.Data.Text.strLen] = '\0'; // Add Null terminator
-            break;
-
-        case	metaMIDIPort: {
-          uint8_t tmpMIDIPort;
-          readByteFromFile(pMFembedded->pFile, &tmpMIDIPort, pTrackNew->ptrNew + 0);
-          pMsgEmbedded->MsgData.MetaEvent.Data.iMIDIPort = tmpMIDIPort;
-          break;
-        }
-        case	metaEndSequence:
-            /* NO DATA */
-            break;
-        case	metaSetTempo: { // looks ok!
-              uint8_t mpqn[3];
-              readChunkFromFile(pMFembedded->pFile, mpqn, pTrackNew->ptrNew, 3);
-              int32_t iMPQN = (mpqn[0] << 16) | (mpqn[1] << 8) | mpqn[2];
-              pMsgEmbedded->MsgData.MetaEvent.Data.Tempo.iBPM = MICROSECONDS_PER_MINUTE / iMPQN;
-            }
-            break;
-        case	metaSMPTEOffset: {
-            // embedded
-            uint8_t tmpSMPTE[5];
-            readChunkFromFile(pMFembedded->pFile, tmpSMPTE, pTrackNew->ptrNew, 5);
-            pMsgEmbedded->MsgData.MetaEvent.Data.SMPTE.iHours = tmpSMPTE[0];
-            pMsgEmbedded->MsgData.MetaEvent.Data.SMPTE.iMins = tmpSMPTE[1];
-            pMsgEmbedded->MsgData.MetaEvent.Data.SMPTE.iSecs = tmpSMPTE[2];
-            pMsgEmbedded->MsgData.MetaEvent.Data.SMPTE.iFrames = tmpSMPTE[3];
-            pMsgEmbedded->MsgData.MetaEvent.Data.SMPTE.iFF = tmpSMPTE[4];
-            break;
-        }
-        case	metaTimeSig: {
-            /* TODO: Variations without 24 & 8 */
-            uint8_t tmpTimeSig[2];
-            readChunkFromFile(pMFembedded->pFile, tmpTimeSig, pTrackNew->ptrNew, 2);
-            pMsgEmbedded->MsgData.MetaEvent.Data.TimeSig.iNom = tmpTimeSig[0];
-            pMsgEmbedded->MsgData.MetaEvent.Data.TimeSig.iDenom = tmpTimeSig[1] * MIDI_NOTE_MINIM;
-        }
-            break;
-        case	metaKeySig: { // TODO: check!
-            uint8_t tmp;
-            readByteFromFile(pMFembedded->pFile, &tmp, pTrackNew->ptrNew);
-
-            if (tmp & 0x80) {
-              /* Do some trendy sign extending in reverse :) */
-              readByteFromFile(pMFembedded->pFile, &tmp, pTrackNew->ptrNew);
-              pMsgEmbedded->MsgData.MetaEvent.Data.KeySig.iKey = (256 - tmp) & keyMaskKey;
-              pMsgEmbedded->MsgData.MetaEvent.Data.KeySig.iKey |= keyMaskNeg;
-            }
-            else {
-              readByteFromFile(pMFembedded->pFile, &tmp, pTrackNew->ptrNew);
-              pMsgEmbedded->MsgData.MetaEvent.Data.KeySig.iKey = (tMIDI_KEYSIG)(tmp & keyMaskKey);
-            }
-
-            readByteFromFile(pMFembedded->pFile, &tmp, pTrackNew->ptrNew + 1);
-            if (tmp)
-              pMsgEmbedded->MsgData.MetaEvent.Data.KeySig.iKey |= keyMaskMin; // TODO: check!
-          }
-          break;
-        case	metaSequencerSpecific:
-          pMsgEmbedded->MsgData.MetaEvent.Data.Sequencer.iSize = pMsgEmbedded->iMsgSize;
-          pMsgEmbedded->MsgData.MetaEvent.Data.Sequencer.pData = pMsgEmbedded->dataEmbedded + 3;
-          break;
-      }
+  pTrack->pEndNew += sizeof(MIDI_LAST_NOTE);
+  for (;;) {
+    uint32_t child = 2 * i + 1;
 
-      pTrackNew->ptrNew += pMsgEmbedded->iMsgSize;
-      pMsgEmbedded->iMsgSize = szEmbedded;
+    if (child >= num)
       break;
-
-    // ----------------------------------
-    // -    System Exclusive Events     -
-    // ----------------------------------
-    case	msgSysEx1:
-    case	msgSysEx2:
-      bptrEmbedded = pTrackNew->ptrNew;
-      pTrackNew->ptrNew += 1; 
-      _midiReadVarLen(pMFembedded, &pTrackNew->ptrNew, &pMsgEmbedded->iMsgSize);
-      szEmbedded = (pTrackNew->ptrNew - bptrEmbedded) + pMsgEmbedded->iMsgSize;
-
-      if (_midiReadTrackCopyData(pMFembedded, pMsgEmbedded, pTrackNew->ptrNew, &szEmbedded, false) == false)
-        return false;
-          
-      /* Embedded: Now copy the data */
-      readChunkFromFile(pMFembedded->pFile, pMsgEmbedded->dataEmbedded, bptrEmbedded, szEmbedded);
-      pTrackNew->ptrNew += pMsgEmbedded->iMsgSize;
-      pMsgEmbedded->iMsgSize = szEmbedded;
-      pMsgEmbedded->MsgData.SysEx.pData = pMsgEmbedded->dataEmbedded;
-      pMsgEmbedded->MsgData.SysEx.iSize = szEmbedded;
+    if (child + 1 < num && _midiWriteNote(pMidiFile, pTrack, child + 1)->end_pos < _midiWriteNote(pMidiFile, pTrack, child)->end_pos)
+      child++;
+    if (last.end_pos <= _midiWriteNote(pMidiFile, pTrack, child)->end_pos)
       break;
+    *_midiWriteNote(pMidiFile, pTrack, i) = *_midiWriteNote(pMidiFile, pTrack, child);
+    i = child;
   }
-  /*
-  ** Standard MIDI messages use a common copy routine
-  */
+  if (num)
+    *_midiWriteNote(pMidiFile, pTrack, i) = last;
+}
 
-  // embedded (needs to be checked!)
-  pMsgEmbedded->bImpliedMsg = false;
-  if ((pMsgEmbedded->iType & 0xf0) != 0xf0) {
-    uint8_t tmpVal = 0;
-    readByteFromFile(pMFembedded->pFile, &tmpVal, pTrackNew->ptrNew);
-    if (tmpVal & 0x80) {
-    }
-    else {
-      pMsgEmbedded->bImpliedMsg = true;
-      pMsgEmbedded->iImpliedMsg = pMsgEmbedded->iLastMsgType;
-      pMsgEmbedded->iMsgSize--;
+// Appends the buffered data of the track to the spill storage
+static bool _midiWriteSpill(_MIDI_FILE* pMidiFile, MIDI_FILE_TRACK* pTrack) {
+  const MIDI_IO* pIo = pMidiFile->pSpillIo;
+  uint32_t header[2], pos = pMidiFile->spill_sz;
+
+  header[0] = 0;
+  header[1] = pTrack->ptrNew - pTrack->pBaseNew;
+  if (!header[1])
+    return true;
+  if (!pIo)
+    return false;
+
+  if (pIo->write(pMidiFile->pSpillContext, pos, header, SPILL_HEADER_SIZE) != SPILL_HEADER_SIZE ||
+      pIo->write(pMidiFile->pSpillContext, pos + SPILL_HEADER_SIZE, pMidiFile->cache.pBuffer + pTrack->pBaseNew, header[1]) != header[1])
+    return false;
+  if (pTrack->spillLast == SPILL_NONE)
+    pTrack->spillFirst = pos;
+  else if (pIo->write(pMidiFile->pSpillContext, pTrack->spillLast, &pos, sizeof(pos)) != sizeof(pos))
+    return false;
+
+  pTrack->spillLast = pos;
+  pTrack->ptrNew = pTrack->pBaseNew;
+  pMidiFile->spill_sz += SPILL_HEADER_SIZE + header[1];
+  return true;
+}
+
+// Gives iTrack its part of the write buffer. The parts of the other tracks shrink: they are moved down in the order
+// the tracks were first used (so they never overlap), and their data is spilled if it doesn't fit anymore. Fails
+// if a track has more pending notes than its new part can hold.
+static bool _midiWritePartition(_MIDI_FILE* pMidiFile, int32_t iTrack) {
+  uint8_t* pBuffer = pMidiFile->cache.pBuffer;
+  uint32_t align = (uint32_t)(-(uintptr_t)pBuffer & (sizeof(uint32_t) - 1)); // the notes need aligned memory
+  uint32_t numSlots = 1, partSize, slot, start;
+  MIDI_FILE_TRACK* pTrack;
+  int32_t i;
+
+  for (i = 0; i < MAX_MIDI_TRACKS; ++i)
+    if (pMidiFile->Track[i].iBlockSize)
+      numSlots++;
+  if (pMidiFile->cache.size < align)
+    return false;
+  partSize = ((pMidiFile->cache.size - align) / numSlots) & ~(uint32_t)(sizeof(uint32_t) - 1);
+  if (partSize < MIDI_WRITE_MIN_BUFFER)
+    return false;
+  for (i = 0; i < MAX_MIDI_TRACKS; ++i)
+    if (pMidiFile->Track[i].iBlockSize && _midiWriteNumNotes(&pMidiFile->Track[i]) * sizeof(MIDI_LAST_NOTE) + MIDI_WRITE_MIN_BUFFER > partSize)
+      return false;
+
+  for (slot = 0; slot < numSlots - 1; ++slot)
+    for (i = 0; i < MAX_MIDI_TRACKS; ++i) {
+      uint32_t used, notesSize;
+
+      pTrack = &pMidiFile->Track[i];
+      if (!pTrack->iBlockSize || pTrack->iSlot != slot)
+        continue;
+      notesSize = _midiWriteNumNotes(pTrack) * sizeof(MIDI_LAST_NOTE);
+      if (pTrack->ptrNew - pTrack->pBaseNew + notesSize > partSize && !_midiWriteSpill(pMidiFile, pTrack))
+        return false;
+
+      // the data moves down first, it never reaches the notes of its old part
+      used = pTrack->ptrNew - pTrack->pBaseNew;
+      start = align + slot * partSize;
+      memmove(pBuffer + start, pBuffer + pTrack->pBaseNew, used);
+      memmove(pBuffer + start + partSize - notesSize, pBuffer + pTrack->pEndNew, notesSize);
+      pTrack->pBaseNew = start;
+      pTrack->ptrNew = start + used;
+      pTrack->pEndNew = start + partSize - notesSize;
+      pTrack->iBlockSize = partSize;
     }
 
-    _midiReadTrackCopyData(pMFembedded, pMsgEmbedded, pTrackNew->ptrNew, &pMsgEmbedded->iMsgSize, true);
-    pTrackNew->ptrNew += pMsgEmbedded->iMsgSize;
+  pTrack = &pMidiFile->Track[iTrack];
+  start = align + (numSlots - 1) * partSize;
+  pTrack->iSlot = (uint8_t)(numSlots - 1);
+  pTrack->pBaseNew = start;
+  pTrack->ptrNew = start;
+  pTrack->pEndNew = start + partSize;
+  pTrack->iBlockSize = partSize;
+  return true;
+}
+
+// Returns the track for writing, after giving it its part of the write buffer on first use
+static MIDI_FILE_TRACK* _midiWriteTrack(_MIDI_FILE* pMidiFile, int32_t iTrack) {
+  MIDI_FILE_TRACK* pTrack;
+
+  if (!IsFilePtrValid(pMidiFile) || !pMidiFile->bOpenForWriting || iTrack < 0 || iTrack >= MAX_MIDI_TRACKS)
+    return NULL;
+
+  pTrack = &pMidiFile->Track[iTrack];
+  if (pTrack->bEnded || (!pTrack->iBlockSize && !_midiWritePartition(pMidiFile, iTrack)))
+    return NULL;
+  return pTrack;
+}
+
+// Appends data to the track, spilling the buffer whenever it is full
+static bool _midiWriteData(_MIDI_FILE* pMidiFile, MIDI_FILE_TRACK* pTrack, const void* pData, uint32_t num) {
+  const uint8_t* pSrc = (const uint8_t*)pData;
+
+  while (num) {
+    uint32_t n = pTrack->pEndNew - pTrack->ptrNew;
+
+    if (!n) {
+      if (!_midiWriteSpill(pMidiFile, pTrack))
+        return false;
+      continue;
+    }
+    if (n > num)
+      n = num;
+    memcpy(pMidiFile->cache.pBuffer + pTrack->ptrNew, pSrc, n);
+    pTrack->ptrNew += n;
+    pTrack->sz += n;
+    pSrc += n;
+    num -= n;
   }
 
   return true;
 }
- // ok!
-void midiReadInitMessage(MIDI_MSG *pMsg) {
-  pMsg->data_sz_embedded = 0;
-  pMsg->bImpliedMsg = false;
+
+#define MIDI_VARLEN_MAX	0x0FFFFFFF	// largest variable-length value, 4 bytes of 7 bits
+
+// Writes a variable-length value (see _midiDecodeVarLen()), returns its size of 1 to 4 bytes, or 0 if the value
+// is larger than MIDI_VARLEN_MAX and can't be written
+static uint32_t _midiEncodeVarLen(uint8_t* pData, uint32_t value) {
+  uint8_t tmp[4];
+  uint32_t num = 0, i;
+
+  if (value > MIDI_VARLEN_MAX)
+    return 0;
+  do {
+    tmp[num++] = (uint8_t)(value & 0x7f);
+    value >>= 7;
+  } while (value);
+
+  for (i = 0; i < num; ++i)
+    pData[i] = tmp[num - 1 - i] | (i < num - 1 ? 0x80 : 0);
+  return num;
 }
 
-// TODO: 'open for write' implementation!
-bool	midiFileClose(MIDI_FILE* _pMFembedded) {
-  _VAR_CAST;
-  if (!IsFilePtrValid(pMFembedded))			return false;
+#define MIDI_WRITE_MAX_HEADER	(4 + 3)	// delta time and a channel message
+
+// Encodes a delta time and an event, as written to a track, into pData of MIDI_WRITE_MAX_HEADER bytes. Channel
+// messages are written in running status: the status byte is left out, if it equals *pStatus, the track's previous
+// one. With bNoteOffAsNoteOn, note-offs are written as note-ons of velocity 0. Meta events and SysEx are not encoded,
+// they follow the delta time and cancel running status. *pStatus is set to the running status after the event.
+// Returns the number of bytes, 0 if the delta time is larger than MIDI_VARLEN_MAX or a channel message too long.
+static inline uint32_t _midiEncodeEvent(const _MIDI_FILE* pMidiFile, uint8_t* pData, uint32_t delta, const uint8_t* pEvent,
+                                        uint32_t eventSize, uint8_t* pStatus) {
+  uint32_t num, i;
+  uint8_t status;
+
+  if (delta < 0x80) {
+    pData[0] = (uint8_t)delta;
+    num = 1;
+  }
+  else if (!(num = _midiEncodeVarLen(pData, delta)))
+    return 0;
 
-  // TODO: open for writing implementation here!
-  if (pMFembedded->pFile)
-    return hal_fclose(pMFembedded->pFile);
+  if (!eventSize || pEvent[0] >= msgSysEx1) {
+    *pStatus = 0;
+    return num;
+  }
+  if (eventSize > 3)
+    return 0;
+
+  status = pEvent[0];
+  if (pMidiFile->bNoteOffAsNoteOn && (status & 0xf0) == msgNoteOff && eventSize == 3)
+    status = (uint8_t)(msgNoteOn | (status & 0x0f));
+  if (status != *pStatus)
+    pData[num++] = status;
+  for (i = 1; i < eventSize; ++i)
+    pData[num++] = pEvent[i];
+  if (status != pEvent[0])
+    pData[num - 1] = 0; // velocity of the note-off
+
+  *pStatus = status;
+  return num;
+}
+
+// Writes an event at the track's current position: the pending delta time, the event and its payload. Without
+// spill storage, the whole event must fit into the buffer, so a failed write never leaves half an event behind.
+// See _midiEncodeEvent() for running status. Fails if the delta time is larger than MIDI_VARLEN_MAX.
+static bool _midiWriteEvent(_MIDI_FILE* pMidiFile, MIDI_FILE_TRACK* pTrack, const uint8_t* pEvent, uint32_t eventSize,
+                            const void* pPayload, uint32_t payloadSize) {
+  uint8_t header[MIDI_WRITE_MAX_HEADER], status = pTrack->last_status;
+  uint32_t headerSize = _midiEncodeEvent(pMidiFile, header, (uint32_t)pTrack->deltaTime, pEvent, eventSize, &status);
+
+  if (!headerSize)
+    return false;
+  if (status)
+    eventSize = 0; // the channel message is part of the header
+
+  if (!pMidiFile->pSpillIo && pTrack->pEndNew - pTrack->ptrNew < headerSize + eventSize + payloadSize)
+    return false;
+  if (!_midiWriteData(pMidiFile, pTrack, header, headerSize) || !_midiWriteData(pMidiFile, pTrack, pEvent, eventSize) ||
+      !_midiWriteData(pMidiFile, pTrack, pPayload, payloadSize))
+    return false;
+
+  pTrack->last_status = status;
+  pTrack->pos += pTrack->deltaTime;
+  pTrack->deltaTime = 0;
+  return true;
+}
+
+// Creates a MIDI file through any I/O backend, which must implement write. The writer uses pBuffer of bufferSize
+// bytes (NULL for the built-in cache buffer) and nothing else: every used track gets an equal part of it for
+// its data and pending notes. Full track buffers are appended to the spill storage pSpillIo
+// (read and write are needed), which may be NULL if the tracks always fit into the buffer. midiFileClose()
+// assembles the file and closes both backends.
+MIDI_FILE  *midiFileCreateIo(_MIDI_FILE *pMidiFile, const MIDI_IO *pIo, void *pContext, const MIDI_IO *pSpillIo, void *pSpillContext, void *pBuffer, uint32_t bufferSize) {
+  int32_t i;
+
+  if (!pMidiFile || !pIo || !pIo->write || (pSpillIo && (!pSpillIo->read || !pSpillIo->write)) ||
+      (pBuffer && bufferSize < MIDI_WRITE_MIN_BUFFER))
+    return NULL;
+
+  memset(pMidiFile, 0, sizeof(_MIDI_FILE));
+  pMidiFile->cache.pBuffer = pBuffer ? (uint8_t*)pBuffer : pMidiFile->cache.data;
+  pMidiFile->cache.size = pBuffer ? bufferSize : PLAYBACK_CACHE_SIZE;
+
+  pMidiFile->pIo = pIo;
+  pMidiFile->pIoContext = pContext;
+  pMidiFile->pSpillIo = pSpillIo;
+  pMidiFile->pSpillContext = pSpillContext;
+  pMidiFile->bOpenForWriting = true;
+  pMidiFile->Header.PPQN = MIDI_PPQN_DEFAULT;
+  pMidiFile->Header.iVersion = MIDI_VERSION_DEFAULT;
+
+  for (i = 0; i < MAX_MIDI_TRACKS; ++i) {
+    pMidiFile->Track[i].spillFirst = SPILL_NONE;
+    pMidiFile->Track[i].spillLast = SPILL_NONE;
+    pMidiFile->Track[i].iDefaultChannel = (uint8_t)(i & 0xf);
+  }
+
+  return (MIDI_FILE *)pMidiFile;
+}
+
+// Creates a MIDI file into a context owned by the caller. Track data, which doesn't fit into the built-in buffer,
+// is spilled to a temporary file. Fails if the file exists, unless bOverwriteIfExists is set.
+MIDI_FILE  *midiFileCreateInstance(_MIDI_FILE *pMidiFile, const char *pFilename, bool bOverwriteIfExists) {
+  FILE* pFileNew = NULL;
+  FILE* pSpillNew = NULL;
+  MIDI_FILE* pMF;
+
+  if (!pMidiFile)
+    return NULL;
+
+  if (!bOverwriteIfExists && hal_fopen(&pFileNew, pFilename) && pFileNew) {
+    hal_fclose(pFileNew);
+    return NULL;
+  }
+
+  if (!hal_fcreate(&pFileNew, pFilename) || !pFileNew)
+    return NULL;
+  if (!hal_ftmpopen(&pSpillNew) || !pSpillNew) {
+    hal_fclose(pFileNew);
+    return NULL;
+  }
+
+  if (!(pMF = midiFileCreateIo(pMidiFile, &midiIoHal, pFileNew, &halIoTmp, pSpillNew, NULL, 0))) {
+    hal_ftmpclose(pSpillNew);
+    hal_fclose(pFileNew);
+  }
+  return pMF;
+}
+
+// Creates a MIDI file into the library's global write instance, so a file may be read with midiFileOpen() meanwhile
+MIDI_FILE  *midiFileCreate(const char *pFilename, bool bOverwriteIfExists) {
+  return midiFileCreateInstance(&_midiFileCreated, pFilename, bOverwriteIfExists);
+}
+
+// iChannel is 1 to 16, as for the user, while MIDI uses 0 to 15. Returns the previous channel.
+int32_t midiFileSetTracksDefaultChannel(MIDI_FILE* _pMFembedded, int32_t iTrack, int32_t iChannel) {
+  int32_t prev;
+
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))	return 0;
+  if (!IsTrackValid(iTrack))	return 0;
+  if (!IsChannelValid(iChannel))	return 0;
+
+  prev = pMFembedded->Track[iTrack].iDefaultChannel + 1;
+  pMFembedded->Track[iTrack].iDefaultChannel = (uint8_t)(iChannel - 1);
+  return prev;
+}
+
+int32_t midiFileGetTracksDefaultChannel(const MIDI_FILE* _pMFembedded, int32_t iTrack) {
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))	return 0;
+  if (!IsTrackValid(iTrack))	return 0;
+
+  return pMFembedded->Track[iTrack].iDefaultChannel + 1;
+}
+
+int32_t midiFileSetPPQN(MIDI_FILE* _pMFembedded, int32_t PPQN) {
+  int32_t prev;
+
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))	return MIDI_PPQN_DEFAULT;
+  prev = pMFembedded->Header.PPQN;
+  pMFembedded->Header.PPQN = (uint16_t)PPQN;
+  return prev;
+}
+
+int32_t midiFileGetPPQN(const MIDI_FILE* _pMFembedded) {
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))	return MIDI_PPQN_DEFAULT;
+  return (int32_t)pMFembedded->Header.PPQN;
+}
+
+// Writes note-offs as note-ons with velocity 0 (the release velocity is dropped), so runs of notes share one
+// status byte in running status. Returns the previous setting.
+bool midiFileSetNoteOffAsNoteOn(MIDI_FILE* _pMFembedded, bool bEnable) {
+  bool prev;
+
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))	return false;
+  prev = pMFembedded->bNoteOffAsNoteOn;
+  pMFembedded->bNoteOffAsNoteOn = bEnable;
+  return prev;
+}
+
+int32_t midiFileSetVersion(MIDI_FILE* _pMFembedded, int32_t iVersion) {
+  int32_t prev;
+
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))	return MIDI_VERSION_DEFAULT;
+  if (iVersion < 0 || iVersion > 2)	return MIDI_VERSION_DEFAULT;
+  prev = pMFembedded->Header.iVersion;
+  pMFembedded->Header.iVersion = (uint16_t)iVersion;
+  return prev;
+}
+
+int32_t midiFileGetVersion(const MIDI_FILE* _pMFembedded) {
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))	return MIDI_VERSION_DEFAULT;
+  return pMFembedded->Header.iVersion;
+}
+
+/*
+** midiRead* Functions
+*/
+
+// Variable-length values use the lower 7 bits of a byte for data and the top bit to signal a following data byte. 
+// If the top bit is set to 1 (0x80), then another value byte follows.
+// A variable - length value may use a maximum of 4 bytes. This means the maximum value that can be represented is 
+// 0x0FFFFFFF (represented as 0xFF, 0xFF, 0xFF, 0x7F).
+// Number of bytes of a value, from the stop bits (continuation bit cleared) of its first 4 bytes: the first byte
+// with a stop bit ends the value. stops must not be 0.
+#if defined(__GNUC__)
+#define _midiVarLenBytes(stops)	((uint32_t)(__builtin_clz(stops) >> 3) + 1)
+#else
+#define _midiVarLenBytes(stops)	((stops) & 0x80000000 ? 1u : (stops) & 0x800000 ? 2u : (stops) & 0x8000 ? 3u : 4u)
+#endif
+
+// Decodes values of more than one byte, see _midiDecodeVarLen().
+static uint32_t _midiDecodeVarLenMultiByte(const uint8_t* pData, uint32_t avail, uint32_t* pValue) {
+  uint32_t value = 0;
+
+  if (avail >= 4) {
+    // Preload all 4 bytes, the length is given by the first byte without the continuation bit
+    uint32_t word = (uint32_t)pData[0] << 24 | (uint32_t)pData[1] << 16 | (uint32_t)pData[2] << 8 | pData[3];
+    uint32_t stops = ~word & 0x80808080;
+    uint32_t numBytes;
+
+    if (!stops)
+      return 0; // overlong
+    numBytes = _midiVarLenBytes(stops);
+
+    value = (word & 0x7f000000) >> 3 | (word & 0x7f0000) >> 2 | (word & 0x7f00) >> 1 | (word & 0x7f);
+    *pValue = value >> (7 * (4 - numBytes));
+    return numBytes;
+  }
+
+  // close to the end of the buffer
+  for (uint32_t i = 0; i < avail; ++i) {
+    value = (value << 7) | (pData[i] & 0x7f);
+    if (!(pData[i] & 0x80)) {
+      *pValue = value;
+      return i + 1;
+    }
+  }
+
+  return 0;
+}
+
+// Returns the number of bytes used, or 0 if the value is truncated or longer than 4 bytes.
+static uint32_t _midiDecodeVarLen(const uint8_t* pData, uint32_t avail, uint32_t* pValue) {
+  if (avail && !(pData[0] & 0x80)) { // most delta times and lengths fit into a single byte
+    *pValue = pData[0];
+    return 1;
+  }
+
+  return _midiDecodeVarLenMultiByte(pData, avail, pValue);
+}
+
+// Decodes the event at the current position of the track from pData, which holds avail bytes of the file from
+// pTrack->ptrNew onwards. Meta and SysEx payloads are skipped, they don't need to be in pData.
+// Returns false, if the event is malformed or pData is too short. The track is left untouched in this case.
+static bool _midiDecodeEvent(const uint8_t* pData, uint32_t avail, MIDI_FILE_TRACK* pTrack, MIDI_EVENT* pEvent) {
+  uint32_t deltaTime, payloadSize, used, idx;
+  uint8_t status;
+
+  if (!(used = _midiDecodeVarLen(pData, avail, &deltaTime)) || used >= avail)
+    return false;
+  idx = used;
+
+  status = pData[idx];
+  if (status & 0x80)
+    idx++;
+  else if (pTrack->last_status) // running status
+    status = pTrack->last_status;
+  else
+    return false;
+
+  pEvent->status = status;
+  pEvent->data1 = 0;
+  pEvent->data2 = 0;
+
+  if (status < 0xf0) {
+    // -------------------------
+    // -    Channel Events     -
+    // -------------------------
+    uint32_t numData = ((status & 0xe0) == 0xc0) ? 1 : 2; // Program Change and Channel Aftertouch carry one byte
+    if (idx + numData > avail)
+      return false;
+
+    pEvent->offset = pTrack->ptrNew + idx;
+    pEvent->data1 = pData[idx];
+    if (numData == 2)
+      pEvent->data2 = pData[idx + 1];
+    idx += numData;
+    pTrack->last_status = status;
+  }
+  else if (status == msgMetaEvent || status == msgSysEx1 || status == msgSysEx2) {
+    // ----------------------------------
+    // -  Meta & System Exclusive Events -
+    // ----------------------------------
+    if (status == msgMetaEvent) {
+      if (idx >= avail)
+        return false;
+      pEvent->data1 = pData[idx++]; // meta event type
+    }
+
+    pEvent->offset = pTrack->ptrNew + idx;
+    if (!(used = _midiDecodeVarLen(&pData[idx], avail - idx, &payloadSize)))
+      return false;
+    idx += used + payloadSize;
+  }
+  else {
+    return false; // realtime and system common messages are not allowed in MIDI files
+  }
+
+  pTrack->ptrNew += idx;
+  pTrack->pos += deltaTime;
+  pEvent->tick = pTrack->pos;
+  return true;
+}
+
+// ok!
+int32_t midiReadGetNumTracks(const MIDI_FILE *_pMFembedded) {
+  _VAR_CAST;
+  return pMFembedded->Header.iNumTracks <= MAX_MIDI_TRACKS ? pMFembedded->Header.iNumTracks : MAX_MIDI_TRACKS;
+}
+
+// Decodes up to maxEvents events of the track into pEvents. The events are decoded in one loop straight from a
+// contiguous buffer, which is either the mapped file or the cache window of the track, so the cache is only
+// consulted again, when an event crosses the end of the window. Meta and SysEx payloads are not read.
+// Events removed by the track's event filter are skipped.
+// Returns the number of events decoded, 0 at the end of the track.
+int32_t midiReadGetNextEvents(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_EVENT* pEvents, int32_t maxEvents) {
+  MIDI_FILE_TRACK* pTrackNew;
+  MIDI_CACHE_WINDOW* pWindow = NULL;
+  const uint8_t* pBuffer;
+  uint32_t bufferStart, bufferEnd;
+  int32_t numEvents = 0;
+  bool bRefilled = false;
+  bool bMissed = false;
+
+  _VAR_CAST;
+  if (!IsTrackValid(iTrack))			return 0;
+
+  pTrackNew = &pMFembedded->Track[iTrack];
+  if (pMFembedded->cache.mode == cacheMapped) {
+    pBuffer = pMFembedded->pMapped;
+    bufferStart = 0;
+    bufferEnd = pMFembedded->file_sz;
+  }
+  else {
+    pWindow = cacheSelectWindow(&pMFembedded->cache, pTrackNew->ptrNew);
+    pBuffer = pWindow->pData;
+    bufferStart = pWindow->startPos;
+    bufferEnd = pWindow->startPos + pWindow->fill;
+  }
+  if (bufferEnd > pTrackNew->pEndNew)
+    bufferEnd = pTrackNew->pEndNew;
+
+  while (numEvents < maxEvents && pTrackNew->ptrNew < pTrackNew->pEndNew) {
+    uint32_t pos = pTrackNew->ptrNew;
+
+    if (pos >= bufferStart && pos < bufferEnd &&
+        _midiDecodeEvent(&pBuffer[pos - bufferStart], bufferEnd - pos, pTrackNew, &pEvents[numEvents])) {
+      if (pTrackNew->eventFilter & MIDI_FILTER_BIT(pEvents[numEvents].status))
+        pEvents[numEvents++].track = (uint8_t)iTrack;
+      bRefilled = false;
+      continue;
+    }
+
+    // The event is incomplete. If the buffer was just filled from this position, the track is broken.
+    if (!pWindow || bRefilled) {
+      pTrackNew->ptrNew = pTrackNew->pEndNew; // stop reading it
+      break;
+    }
+
+    bMissed = true;
+    if (cacheRefill(pMFembedded, pWindow, pos, MIDI_EVENT_MAX_HEADER_SIZE) == 0) {
+      pTrackNew->ptrNew = pTrackNew->pEndNew; // end of file, counted in the stats
+      break;
+    }
+
+    pBuffer = pWindow->pData; // may have been swapped in prefetch mode
+    bufferStart = pWindow->startPos;
+    bufferEnd = pWindow->startPos + pWindow->fill;
+    if (bufferEnd > pTrackNew->pEndNew)
+      bufferEnd = pTrackNew->pEndNew;
+    bRefilled = true;
+  }
+
+  if (pWindow) {
+    if (bMissed)
+      pWindow->stats.misses++;
+    else
+      pWindow->stats.hits++;
+  }
+
+  return numEvents;
+}
+
+// Reads the next event of the track into the compact event record. Meta and SysEx payloads are not read, use
+// midiReadGetEventPayload() to get a handle to them.
+bool midiReadGetNextEvent(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_EVENT* pEvent) {
+  return midiReadGetNextEvents(_pMFembedded, iTrack, pEvent, 1) == 1;
+}
+
+// Returns a handle to the payload of a meta or SysEx event. No payload bytes are read.
+bool midiReadGetEventPayload(const MIDI_FILE* _pMFembedded, const MIDI_EVENT* pEvent, MIDI_PAYLOAD* pPayload) {
+  uint8_t varLen[4];
+  uint32_t num, used;
+
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))	return false;
+  if (pEvent->status != msgMetaEvent && pEvent->status != msgSysEx1 && pEvent->status != msgSysEx2)
+    return false;
+
+  num = sizeof(varLen);
+  if (pEvent->track < MAX_MIDI_TRACKS && pMFembedded->Track[pEvent->track].pEndNew - pEvent->offset < num)
+    num = pMFembedded->Track[pEvent->track].pEndNew - pEvent->offset; // don't read over the end of the track
+
+  num = readChunkFromFile(pMFembedded, varLen, pEvent->offset, num);
+  if (!(used = _midiDecodeVarLen(varLen, num, &pPayload->size)))
+    return false;
+
+  pPayload->offset = pEvent->offset + used;
+  return true;
+}
+
+// Copies up to num bytes of the payload, starting at pos within the payload. Returns the number of bytes copied.
+uint32_t midiReadGetPayloadData(const MIDI_FILE* _pMFembedded, const MIDI_PAYLOAD* pPayload, uint32_t pos, void* dst, uint32_t num) {
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))	return 0;
+  if (pos >= pPayload->size)
+    return 0;
+
+  if (num > pPayload->size - pos)
+    num = pPayload->size - pos;
+
+  return readChunkFromFile(pMFembedded, dst, pPayload->offset + pos, num);
+}
+
+// Returns a pointer to the complete payload, if the file is mapped, otherwise NULL.
+const uint8_t* midiReadGetPayloadPtr(const MIDI_FILE* _pMFembedded, const MIDI_PAYLOAD* pPayload) {
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))	return NULL;
+  if (pMFembedded->cache.mode != cacheMapped || pPayload->offset > pMFembedded->file_sz ||
+      pPayload->size > pMFembedded->file_sz - pPayload->offset)
+    return NULL;
+
+  return &pMFembedded->pMapped[pPayload->offset];
+}
+
+// Expands a compact event into a MIDI_MSG. Meta and SysEx data is copied into dataEmbedded, starting with the
+// status byte. Data beyond META_EVENT_MAX_DATA_SIZE is truncated: iMsgSize is the number of bytes copied, iMsgFullSize
+// the size of the event in the file.
+bool midiReadEventToMessage(const MIDI_FILE* _pMFembedded, const MIDI_EVENT* pEvent, MIDI_MSG* pMsgEmbedded) {
+  uint32_t rawOffset, headerSize, szEmbedded;
+  MIDI_PAYLOAD payload;
+  uint8_t* pPayload;
+
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))	return false;
+
+  pMsgEmbedded->dwAbsPos = pEvent->tick;
+  pMsgEmbedded->bImpliedMsg = false;
+
+  if (pEvent->status < 0xf0) {
+    // -------------------------
+    // -    Channel Events     -
+    // -------------------------
+    int32_t iChannel = (pEvent->status & 0x0f) + 1;
+    uint8_t firstByte = 0;
+
+    pMsgEmbedded->iType = (tMIDI_MSG)(pEvent->status & 0xf0);
+    pMsgEmbedded->iMsgSize = ((pEvent->status & 0xe0) == 0xc0) ? 2 : 3;
+
+    // The last delta time byte never has bit 7 set, so a missing status byte is easy to detect
+    readByteFromFile(pMFembedded, &firstByte, pEvent->offset - 1);
+    if (!(firstByte & 0x80)) {
+      pMsgEmbedded->bImpliedMsg = true;
+      pMsgEmbedded->iImpliedMsg = pMsgEmbedded->iType;
+      pMsgEmbedded->iMsgSize--;
+    }
+    pMsgEmbedded->iMsgFullSize = pMsgEmbedded->iMsgSize;
+    szEmbedded = pMsgEmbedded->iMsgSize;
+    readChunkFromFile(pMFembedded, pMsgEmbedded->dataEmbedded, pEvent->offset - (pMsgEmbedded->bImpliedMsg ? 0 : 1), szEmbedded);
+    pMsgEmbedded->data_sz_embedded = szEmbedded;
+
+    switch (pMsgEmbedded->iType) {
+      case	msgNoteOff: // 0x08 'Note Off'
+        pMsgEmbedded->MsgData.NoteOff.iChannel = iChannel;
+        pMsgEmbedded->MsgData.NoteOff.iNote = pEvent->data1;
+        break;
+      case	msgNoteOn: // 0x09 'Note On'
+        pMsgEmbedded->MsgData.NoteOn.iChannel = iChannel;
+        pMsgEmbedded->MsgData.NoteOn.iNote = pEvent->data1;
+        pMsgEmbedded->MsgData.NoteOn.iVolume = pEvent->data2;
+        break;
+      case	msgNoteKeyPressure: // 0x0A 'Note Aftertouch'
+        pMsgEmbedded->MsgData.NoteKeyPressure.iChannel = iChannel;
+        pMsgEmbedded->MsgData.NoteKeyPressure.iNote = pEvent->data1;
+        pMsgEmbedded->MsgData.NoteKeyPressure.iPressure = pEvent->data2;
+        break;
+      case	msgControlChange: // 0x0B 'Controller'
+        pMsgEmbedded->MsgData.NoteParameter.iChannel = iChannel;
+        pMsgEmbedded->MsgData.NoteParameter.iControl = (tMIDI_CC)pEvent->data1;
+        pMsgEmbedded->MsgData.NoteParameter.iParam = pEvent->data2;
+        break;
+      case	msgSetProgram: // 0x0C 'Program Change'
+        pMsgEmbedded->MsgData.ChangeProgram.iChannel = iChannel;
+        pMsgEmbedded->MsgData.ChangeProgram.iProgram = pEvent->data1;
+        break;
+      case	msgChangePressure: // 0x0D 'Channel Aftertouch'
+        pMsgEmbedded->MsgData.ChangePressure.iChannel = iChannel;
+        pMsgEmbedded->MsgData.ChangePressure.iPressure = pEvent->data1;
+        break;
+      case	msgSetPitchWheel: // 0x0E 'Pitch Bend'
+        pMsgEmbedded->MsgData.PitchWheel.iChannel = iChannel;
+        pMsgEmbedded->MsgData.PitchWheel.iPitch = (pEvent->data1 | (pEvent->data2 << 7)) - MIDI_WHEEL_CENTRE;
+        break;
+      default:
+        break;
+    }
+
+    pMsgEmbedded->iLastMsgType = pMsgEmbedded->iType;
+    pMsgEmbedded->iLastMsgChnl = (uint8_t)iChannel;
+    return true;
+  }
+
+  // -------------------------------------
+  // -  Meta & System Exclusive Events   -
+  // -------------------------------------
+  if (!midiReadGetEventPayload(pMFembedded, pEvent, &payload))
+    return false;
+
+  pMsgEmbedded->iType = (tMIDI_MSG)pEvent->status;
+  pMsgEmbedded->iLastMsgType = pMsgEmbedded->iType;
+
+  rawOffset = pEvent->offset - (pEvent->status == msgMetaEvent ? 2 : 1); // position of the status byte
+  headerSize = payload.offset - rawOffset;
+  pMsgEmbedded->iMsgFullSize = headerSize + payload.size;
+
+  szEmbedded = pMsgEmbedded->iMsgFullSize;
+  if (szEmbedded > META_EVENT_MAX_DATA_SIZE)
+    szEmbedded = META_EVENT_MAX_DATA_SIZE; // truncate meta data, since we don't have enough space
+  pMsgEmbedded->iMsgSize = szEmbedded;
+
+  memset(pMsgEmbedded->dataEmbedded, 0, sizeof(pMsgEmbedded->dataEmbedded)); // short (broken) events read as 0
+  pMsgEmbedded->data_sz_embedded = readChunkFromFile(pMFembedded, pMsgEmbedded->dataEmbedded, rawOffset, szEmbedded);
+  pPayload = &pMsgEmbedded->dataEmbedded[headerSize < szEmbedded ? headerSize : szEmbedded];
+
+  if (pEvent->status != msgMetaEvent) {
+    // ----------------------------------
+    // -    System Exclusive Events     -
+    // ----------------------------------
+    pMsgEmbedded->MsgData.SysEx.pData = pMsgEmbedded->dataEmbedded;
+    pMsgEmbedded->MsgData.SysEx.iSize = szEmbedded;
+    return true;
+  }
+
+  // -------------------------
+  // -    Meta Events     -
+  // -------------------------
+  pMsgEmbedded->MsgData.MetaEvent.iType = (tMIDI_META)pEvent->data1;
+
+  /* Place the META data it in a neat structure also for embedded! */
+  switch(pMsgEmbedded->MsgData.MetaEvent.iType) {
+    case	metaSequenceNumber:
+      pMsgEmbedded->MsgData.MetaEvent.Data.iSequenceNumber = pPayload[0];
+      break;
+
+    case	metaTextEvent:
+    case	metaCopyright:
+    case	metaTrackName:
+    case	metaInstrument:
+    case	metaLyric:
+    case	metaMarker:
+    case	metaCuePoint:
+      pMsgEmbedded->MsgData.MetaEvent.Data.Text.strLen = szEmbedded > headerSize ? szEmbedded - headerSize : 0;
+      pMsgEmbedded->MsgData.MetaEvent.Data.Text.pData = pPayload;
+      pPayload[pMsgEmbedded->MsgData.MetaEvent.Data.Text.strLen] = '\0'; // Add Null terminator
+      break;
+
+    case	metaMIDIPort:
+      pMsgEmbedded->MsgData.MetaEvent.Data.iMIDIPort = pPayload[0];
+      break;
+
+    case	metaEndSequence:
+      /* NO DATA */
+      break;
+
+    case	metaSetTempo: { // looks ok!
+      int32_t iMPQN = (pPayload[0] << 16) | (pPayload[1] << 8) | pPayload[2];
+      pMsgEmbedded->MsgData.MetaEvent.Data.Tempo.iBPM = iMPQN ? MICROSECONDS_PER_MINUTE / iMPQN : MIDI_BPM_DEFAULT;
+      break;
+    }
+
+    case	metaSMPTEOffset:
+      pMsgEmbedded->MsgData.MetaEvent.Data.SMPTE.iHours = pPayload[0];
+      pMsgEmbedded->MsgData.MetaEvent.Data.SMPTE.iMins = pPayload[1];
+      pMsgEmbedded->MsgData.MetaEvent.Data.SMPTE.iSecs = pPayload[2];
+      pMsgEmbedded->MsgData.MetaEvent.Data.SMPTE.iFrames = pPayload[3];
+      pMsgEmbedded->MsgData.MetaEvent.Data.SMPTE.iFF = pPayload[4];
+      break;
+
+    case	metaTimeSig:
+      /* TODO: Variations without 24 & 8 */
+      pMsgEmbedded->MsgData.MetaEvent.Data.TimeSig.iNom = pPayload[0];
+      pMsgEmbedded->MsgData.MetaEvent.Data.TimeSig.iDenom = pPayload[1] * MIDI_NOTE_MINIM;
+      break;
+
+    case	metaKeySig: // TODO: check!
+      if (pPayload[0] & 0x80) {
+        /* Do some trendy sign extending in reverse :) */
+        pMsgEmbedded->MsgData.MetaEvent.Data.KeySig.iKey = (tMIDI_KEYSIG)((256 - pPayload[0]) & keyMaskKey);
+        pMsgEmbedded->MsgData.MetaEvent.Data.KeySig.iKey |= keyMaskNeg;
+      }
+      else {
+        pMsgEmbedded->MsgData.MetaEvent.Data.KeySig.iKey = (tMIDI_KEYSIG)(pPayload[0] & keyMaskKey);
+      }
+
+      if (pPayload[1])
+        pMsgEmbedded->MsgData.MetaEvent.Data.KeySig.iKey |= keyMaskMin; // TODO: check!
+      break;
+
+    case	metaSequencerSpecific:
+      pMsgEmbedded->MsgData.MetaEvent.Data.Sequencer.iSize = payload.size;
+      pMsgEmbedded->MsgData.MetaEvent.Data.Sequencer.pData = pPayload;
+      break;
+
+    default:
+      break;
+  }
+
+  return true;
+}
+
+// looks ok! (TODO: running status interruption by realtime messages?)
+bool midiReadGetNextMessage(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_MSG* pMsgEmbedded) {
+  MIDI_EVENT event;
+  uint32_t lastPos;
+
+  _VAR_CAST;
+  if (!IsTrackValid(iTrack))			return false;
+
+  lastPos = pMFembedded->Track[iTrack].pos;
+  if (!midiReadGetNextEvent(pMFembedded, iTrack, &event))
+    return false;
+
+  pMsgEmbedded->dt = event.tick - lastPos;
+  return midiReadEventToMessage(pMFembedded, &event, pMsgEmbedded);
+}
+
+// Sort key of a merged event: the position first, then meta events and SysEx before channel events, then the track
+#define _midiMergeKey(pEvent)	(((uint64_t)(pEvent)->tick << 9) | ((pEvent)->status < msgSysEx1 ? 0x100 : 0) | (pEvent)->track)
+
+static void _midiMergeSiftDown(MIDI_MERGE* pMerge, int32_t i) {
+  uint64_t key = pMerge->heap[i];
+  int32_t child;
+
+  while ((child = 2 * i + 1) < pMerge->num) {
+    if (child + 1 < pMerge->num && pMerge->heap[child + 1] < pMerge->heap[child])
+      child++;
+    if (key <= pMerge->heap[child])
+      break;
+    pMerge->heap[i] = pMerge->heap[child];
+    i = child;
+  }
+  pMerge->heap[i] = key;
+}
+
+// Starts reading the events of all tracks in time order, from the current position of every track (i.e. after
+// opening the file, midiFileRewindTrack() or midiFileSeek()). Events at the same tick come in a fixed order: meta
+// events and SysEx first, then by track, and the events of a track in file order. Format 2 files hold independent
+// sequences, which are merged just the same.
+bool midiReadInitMerge(MIDI_FILE* _pMFembedded, MIDI_MERGE* pMerge) {
+  int32_t i, numTracks;
+
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded) || !pMerge)	return false;
+
+  pMerge->num = 0;
+  numTracks = midiReadGetNumTracks(pMFembedded);
+  for (i = 0; i < numTracks; ++i)
+    if (midiReadGetNextEvent(pMFembedded, i, &pMerge->next[i]))
+      pMerge->heap[pMerge->num++] = _midiMergeKey(&pMerge->next[i]);
+  for (i = pMerge->num / 2 - 1; i >= 0; --i)
+    _midiMergeSiftDown(pMerge, i);
+  return true;
+}
+
+// Returns the next event of the file in time order, its track is in pEvent->track. Reads one event ahead on the
+// track. Returns false, when all tracks are finished.
+bool midiReadGetNextMergedEvent(MIDI_FILE* _pMFembedded, MIDI_MERGE* pMerge, MIDI_EVENT* pEvent) {
+  MIDI_EVENT* pNext;
+
+  _VAR_CAST;
+  if (!pMerge || !pMerge->num)	return false;
+
+  pNext = &pMerge->next[pMerge->heap[0] & 0xff];
+  *pEvent = *pNext;
+  if (midiReadGetNextEvent(pMFembedded, pEvent->track, pNext))
+    pMerge->heap[0] = _midiMergeKey(pNext);
+  else
+    pMerge->heap[0] = pMerge->heap[--pMerge->num]; // track finished
+  _midiMergeSiftDown(pMerge, 0);
+  return true;
+}
+
+// ok!
+void midiReadInitMessage(MIDI_MSG *pMsg) {
+  pMsg->data_sz_embedded = 0;
+  pMsg->bImpliedMsg = false;
+}
+
+static void _midiRewindTrack(MIDI_FILE_TRACK* pTrack) {
+  pTrack->ptrNew = pTrack->pBaseNew + 8;
+  pTrack->pos = 0;
+  pTrack->last_status = 0;
+}
+
+// Scans all tracks once and records a checkpoint every 'interval' ticks into pPoints, which must stay valid as long
+// as the index is used. If pPoints is too small, the last checkpoints are missing and seeking towards the end
+// of the file decodes more events. The read position of the tracks is not changed.
+bool midiFileBuildSeekIndex(MIDI_FILE* _pMFembedded, MIDI_SEEK_INDEX* pIndex, MIDI_SEEK_POINT* pPoints, uint32_t maxPoints, uint32_t interval) {
+  uint32_t usedPoints = 0;
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))	return false;
+  if (!pPoints || !maxPoints || !interval) return false;
+
+  memset(pIndex, 0, sizeof(MIDI_SEEK_INDEX));
+  pIndex->pPoints = pPoints;
+  pIndex->maxPoints = maxPoints;
+  pIndex->interval = interval;
+
+  for (int32_t iTrack = 0; iTrack < midiReadGetNumTracks(pMFembedded); ++iTrack) {
+    MIDI_FILE_TRACK* pTrack = &pMFembedded->Track[iTrack];
+    MIDI_FILE_TRACK savedTrack = *pTrack;
+    uint32_t nextTick = 0;
+    MIDI_EVENT event;
+
+    _midiRewindTrack(pTrack);
+    pTrack->eventFilter = MIDI_FILTER_ALL;
+    pIndex->firstPoint[iTrack] = usedPoints;
+
+    for (;;) {
+      MIDI_SEEK_POINT point = { pTrack->pos, pTrack->ptrNew, pTrack->last_status };
+
+      if (!midiReadGetNextEvent(pMFembedded, iTrack, &event))
+        break;
+
+      if (event.tick >= nextTick && usedPoints < maxPoints) {
+        pPoints[usedPoints++] = point;
+        pIndex->numPoints[iTrack]++;
+        nextTick = event.tick + interval;
+      }
+      if (event.tick > pIndex->lastTick)
+        pIndex->lastTick = event.tick;
+    }
+
+    *pTrack = savedTrack;
+  }
+
+  return true;
+}
+
+// Positions a track at its first event again, i.e. to replay a format 2 sequence
+bool midiFileRewindTrack(MIDI_FILE* _pMFembedded, int32_t iTrack) {
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))	return false;
+  if (!IsTrackValid(iTrack))			return false;
+
+  _midiRewindTrack(&pMFembedded->Track[iTrack]);
+  return true;
+}
+
+// Positions all tracks, so the next event read is the first one at or after 'tick'. Without an index (pIndex is
+// NULL) all tracks are decoded from the start.
+bool midiFileSeek(MIDI_FILE* _pMFembedded, const MIDI_SEEK_INDEX* pIndex, uint32_t tick) {
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))	return false;
+
+  for (int32_t iTrack = 0; iTrack < midiReadGetNumTracks(pMFembedded); ++iTrack) {
+    MIDI_FILE_TRACK* pTrack = &pMFembedded->Track[iTrack];
+    MIDI_EVENT event;
+
+    _midiRewindTrack(pTrack);
+
+    if (pIndex && pIndex->numPoints[iTrack]) {
+      // Find the last checkpoint before 'tick'. Events at 'tick' itself may lie before a checkpoint at 'tick'.
+      const MIDI_SEEK_POINT* pPoints = &pIndex->pPoints[pIndex->firstPoint[iTrack]];
+      int32_t lo = 0, hi = pIndex->numPoints[iTrack] - 1;
+
+      while (lo < hi) {
+        int32_t mid = (lo + hi + 1) / 2;
+        if (pPoints[mid].tick < tick)
+          lo = mid;
+        else
+          hi = mid - 1;
+      }
+
+      pTrack->ptrNew = pPoints[lo].offset;
+      pTrack->pos = pPoints[lo].tick;
+      pTrack->last_status = pPoints[lo].last_status;
+    }
+
+    // short forward decode up to the requested position
+    for (;;) {
+      uint32_t ptrNew = pTrack->ptrNew, pos = pTrack->pos;
+      uint8_t last_status = pTrack->last_status;
+
+      if (!midiReadGetNextEvent(pMFembedded, iTrack, &event))
+        break;
+
+      if (event.tick >= tick) {
+        pTrack->ptrNew = ptrNew;
+        pTrack->pos = pos;
+        pTrack->last_status = last_status;
+        break;
+      }
+    }
+  }
+
+  return true;
+}
+
+// Inserts a tempo change into the map, sorted by tick. A later change at the same tick replaces an earlier one.
+static bool _midiTempoMapInsert(MIDI_TEMPO_MAP* pMap, uint32_t tick, uint32_t usPerQuarter) {
+  uint32_t i = pMap->numPoints;
+
+  while (i > 0 && pMap->pPoints[i - 1].tick > tick)
+    i--;
+
+  if (i > 0 && pMap->pPoints[i - 1].tick == tick) {
+    pMap->pPoints[i - 1].usPerQuarter = usPerQuarter;
+    return true;
+  }
+
+  if (pMap->numPoints >= pMap->maxPoints)
+    return false;
+
+  memmove(&pMap->pPoints[i + 1], &pMap->pPoints[i], (pMap->numPoints - i) * sizeof(MIDI_TEMPO_POINT));
+  pMap->pPoints[i].tick = tick;
+  pMap->pPoints[i].usPerQuarter = usPerQuarter;
+  pMap->numPoints++;
+  return true;
+}
+
+// Time of 'tick' within the tempo section starting at pPoint, in 1/PPQN microseconds
+static uint64_t _midiTempoSectionTime(const MIDI_TEMPO_POINT* pPoint, uint32_t tick) {
+  return pPoint->time + (uint64_t)(tick - pPoint->tick) * pPoint->usPerQuarter;
+}
+
+// Collects the tempo changes of all tracks into pPoints and precalculates the time of each change, so ticks and
+// time can be converted in both directions by a binary search. Fails, if pPoints is too small.
+// The read position of the tracks is not changed.
+bool midiFileBuildTempoMap(MIDI_FILE* _pMFembedded, MIDI_TEMPO_MAP* pMap, MIDI_TEMPO_POINT* pPoints, uint32_t maxPoints) {
+  bool bComplete = true;
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))	return false;
+  if (!pPoints || !maxPoints) return false;
+
+  pMap->pPoints = pPoints;
+  pMap->maxPoints = maxPoints;
+  pMap->numPoints = 0;
+  pMap->PPQN = pMFembedded->Header.PPQN ? pMFembedded->Header.PPQN : MIDI_PPQN_DEFAULT;
+  _midiTempoMapInsert(pMap, 0, MIDI_US_PER_QUARTER_DEFAULT);
+
+  for (int32_t iTrack = 0; iTrack < midiReadGetNumTracks(pMFembedded) && bComplete; ++iTrack) {
+    MIDI_FILE_TRACK* pTrack = &pMFembedded->Track[iTrack];
+    MIDI_FILE_TRACK savedTrack = *pTrack;
+    MIDI_EVENT event;
+
+    _midiRewindTrack(pTrack);
+    pTrack->eventFilter = MIDI_FILTER_META;
+
+    while (bComplete && midiReadGetNextEvent(pMFembedded, iTrack, &event)) {
+      MIDI_PAYLOAD payload;
+      uint8_t data[3];
+
+      if (event.data1 != metaSetTempo || !midiReadGetEventPayload(pMFembedded, &event, &payload) ||
+          midiReadGetPayloadData(pMFembedded, &payload, 0, data, sizeof(data)) != sizeof(data))
+        continue;
+
+      uint32_t usPerQuarter = (data[0] << 16) | (data[1] << 8) | data[2];
+      if (usPerQuarter)
+        bComplete = _midiTempoMapInsert(pMap, event.tick, usPerQuarter);
+    }
+
+    *pTrack = savedTrack;
+  }
+
+  pMap->pPoints[0].time = 0;
+  for (uint32_t i = 1; i < pMap->numPoints; ++i)
+    pMap->pPoints[i].time = _midiTempoSectionTime(&pMap->pPoints[i - 1], pMap->pPoints[i].tick);
+
+  return bComplete;
+}
+
+// Returns the index of the last tempo section, which starts at or before 'tick'
+static uint32_t _midiTempoMapFindTick(const MIDI_TEMPO_MAP* pMap, uint32_t tick) {
+  uint32_t lo = 0, hi = pMap->numPoints - 1;
+
+  while (lo < hi) {
+    uint32_t mid = (lo + hi + 1) / 2;
+    if (pMap->pPoints[mid].tick <= tick)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  return lo;
+}
+
+// Returns the time of 'tick' in microseconds. It is rounded up, so it is the first microsecond, at which the tick
+// is due, and midiTempoMapUsToTick() returns the same tick again.
+uint64_t midiTempoMapTickToUs(const MIDI_TEMPO_MAP* pMap, uint32_t tick) {
+  uint64_t time = _midiTempoSectionTime(&pMap->pPoints[_midiTempoMapFindTick(pMap, tick)], tick);
+  return (time + pMap->PPQN - 1) / pMap->PPQN;
+}
+
+// Returns the last tick, which is due at the time 'us'
+uint32_t midiTempoMapUsToTick(const MIDI_TEMPO_MAP* pMap, uint64_t us) {
+  const MIDI_TEMPO_POINT* pPoint;
+  uint64_t time = us * pMap->PPQN;
+  uint32_t lo = 0, hi = pMap->numPoints - 1;
+
+  while (lo < hi) {
+    uint32_t mid = (lo + hi + 1) / 2;
+    if (pMap->pPoints[mid].time <= time)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  pPoint = &pMap->pPoints[lo];
+  return pPoint->tick + (uint32_t)((time - pPoint->time) / pPoint->usPerQuarter);
+}
+
+// Returns the tempo in microseconds per quarter note at 'tick'
+uint32_t midiTempoMapGetTempo(const MIDI_TEMPO_MAP* pMap, uint32_t tick) {
+  return pMap->pPoints[_midiTempoMapFindTick(pMap, tick)].usPerQuarter;
+}
+
+/*
+** Probing: reads the summary of a file with as few bytes as possible, without a _MIDI_FILE and its cache
+*/
+typedef struct {
+  const MIDI_IO* pIo;
+  void* pContext;
+  uint32_t startPos;      // file position of data[0]
+  uint32_t fill;
+  uint32_t bytesRead;
+  uint8_t data[MIDI_PROBE_BUFFER_SIZE];
+
+  uint64_t time;          // ticks * us per quarter up to tempoTick, for the duration
+  uint32_t tempoTick;     // tick of the last tempo change
+  uint32_t usPerQuarter;  // tempo from there on
+} _MIDI_PROBE;
+
+// Returns the data at pos with up to num bytes (less at the end of the file) in the buffer, or NULL at the end of
+// the file. *pAvail is set to the number of bytes available from pos.
+static const uint8_t* _midiProbeRead(_MIDI_PROBE* pProbe, uint32_t pos, uint32_t num, uint32_t* pAvail) {
+  bool bAtEnd = pProbe->fill < MIDI_PROBE_BUFFER_SIZE; // the buffer holds the end of the file
+
+  if (pos < pProbe->startPos || pos >= pProbe->startPos + pProbe->fill ||
+      (pos + num > pProbe->startPos + pProbe->fill && !bAtEnd)) {
+    pProbe->startPos = pos;
+    pProbe->fill = pProbe->pIo->read(pProbe->pContext, pos, pProbe->data, MIDI_PROBE_BUFFER_SIZE);
+    pProbe->bytesRead += pProbe->fill;
+    if (!pProbe->fill)
+      return NULL;
+  }
+
+  *pAvail = pProbe->startPos + pProbe->fill - pos;
+  return &pProbe->data[pos - pProbe->startPos];
+}
+
+static uint32_t _midiProbeReadAt(void* pContext, uint32_t pos, void* dst, uint32_t num) {
+  uint32_t avail;
+  const uint8_t* pData = _midiProbeRead((_MIDI_PROBE*)pContext, pos, num, &avail);
+
+  if (!pData)
+    return 0;
+  if (num > avail)
+    num = avail;
+  memcpy(dst, pData, num);
+  return num;
+}
+
+// Reads the events of a track chunk. Without bDuration, only the events at tick 0 are read, to find the first
+// track name and the initial tempo. With bDuration, the whole track is read. Returns its last tick.
+// Tempo changes are only taken from the first track (bTempoTrack), as the standard demands.
+static uint32_t _midiProbeTrack(_MIDI_PROBE* pProbe, uint32_t start, uint32_t end, MIDI_FILE_INFO* pInfo,
+    bool bDuration, bool bTempoTrack) {
+  MIDI_FILE_TRACK track;
+  MIDI_EVENT event;
+
+  memset(&track, 0, sizeof(track));
+  track.ptrNew = start;
+
+  while (track.ptrNew < end) {
+    uint32_t avail, payloadSize, used;
+    const uint8_t* pData = _midiProbeRead(pProbe, track.ptrNew, MIDI_EVENT_MAX_HEADER_SIZE, &avail);
+
+    if (!pData || !_midiDecodeEvent(pData, avail < end - track.ptrNew ? avail : end - track.ptrNew, &track, &event))
+      break; // end of file or broken track
+    if (!bDuration && event.tick > 0)
+      break;
+    if (event.status != msgMetaEvent || (event.data1 != metaTrackName && event.data1 != metaSetTempo))
+      continue;
+
+    pData = _midiProbeRead(pProbe, event.offset, 4, &avail);
+    if (!pData || !(used = _midiDecodeVarLen(pData, avail, &payloadSize)))
+      continue;
+    if (payloadSize > sizeof(pInfo->trackName) - 1)
+      payloadSize = sizeof(pInfo->trackName) - 1;
+    if (!(pData = _midiProbeRead(pProbe, event.offset + used, payloadSize, &avail)))
+      continue;
+    if (payloadSize > avail)
+      payloadSize = avail;
+
+    if (event.data1 == metaTrackName && !pInfo->trackName[0]) {
+      memcpy(pInfo->trackName, pData, payloadSize);
+      pInfo->trackName[payloadSize] = '\0';
+    }
+    else if (event.data1 == metaSetTempo && payloadSize >= 3 && bTempoTrack) {
+      uint32_t usPerQuarter = ((uint32_t)pData[0] << 16) | ((uint32_t)pData[1] << 8) | pData[2];
+      if (event.tick == 0)
+        pInfo->usPerQuarter = usPerQuarter;
+      pProbe->time += (uint64_t)(event.tick - pProbe->tempoTick) * pProbe->usPerQuarter;
+      pProbe->tempoTick = event.tick;
+      pProbe->usPerQuarter = usPerQuarter;
+    }
+  }
+
+  return track.pos;
+}
+
+// Reads the summary of a file for a catalog: format, tracks, PPQN, the name of the first track and the initial
+// tempo. Usually, a single read of MIDI_PROBE_BUFFER_SIZE bytes is enough for this. With bDuration, all tracks are
+// read to get the length, which costs about as much as reading the whole file.
+bool midiFileProbe(const char* pFilename, MIDI_FILE_INFO* pInfo, bool bDuration) {
+  FILE* pFile = NULL;
+  bool bProbed;
+
+  if (!hal_fopen(&pFile, pFilename) || !pFile)
+    return false;
+
+  bProbed = midiFileProbeIo(&midiIoHal, pFile, pInfo, bDuration);
+  hal_fclose(pFile);
+  return bProbed;
+}
+
+// Like midiFileProbe(), but reads from an I/O backend. The context is not closed.
+bool midiFileProbeIo(const MIDI_IO* pIo, void* pContext, MIDI_FILE_INFO* pInfo, bool bDuration) {
+  _MIDI_PROBE probe;
+  const uint8_t* pData;
+  uint32_t avail, pos, headerSize, size, next, fileSize;
+
+  memset(pInfo, 0, sizeof(MIDI_FILE_INFO));
+  pInfo->usPerQuarter = MIDI_US_PER_QUARTER_DEFAULT;
+  if (!pIo || !pIo->read)
+    return false;
+
+  memset(&probe, 0, sizeof(probe));
+  probe.pIo = pIo;
+  probe.pContext = pContext;
+  probe.usPerQuarter = MIDI_US_PER_QUARTER_DEFAULT;
+
+  fileSize = pIo->size ? pIo->size(pContext) : UINT32_MAX;
+  if ((pos = _midiFindSmf(_midiProbeReadAt, &probe, fileSize)) == UINT32_MAX)
+    return false;
+  pData = _midiProbeRead(&probe, pos, 14, &avail);
+  if (!pData || avail < 14)
+    return false;
+
+  headerSize = ((uint32_t)pData[4] << 24) | ((uint32_t)pData[5] << 16) | ((uint32_t)pData[6] << 8) | pData[7];
+  pInfo->format = (uint16_t)((pData[8] << 8) | pData[9]);
+  pInfo->numTracks = (uint16_t)((pData[10] << 8) | pData[11]);
+  pInfo->PPQN = (uint16_t)((pData[12] << 8) | pData[13]);
+
+  if ((pos = _midiNextChunk(pos, headerSize, fileSize)) == UINT32_MAX)
+    return false;
+  for (uint32_t iTrack = 0; iTrack < pInfo->numTracks; pos = next) {
+    uint32_t lastTick;
+
+    pData = _midiProbeRead(&probe, pos, 8, &avail);
+    if (!pData || avail < 8)
+      break;
+    size = ((uint32_t)pData[4] << 24) | ((uint32_t)pData[5] << 16) | ((uint32_t)pData[6] << 8) | pData[7];
+    next = _midiNextChunk(pos, size, fileSize);
+    if (memcmp(pData, "MTrk", 4) != 0) {
+      if (next == UINT32_MAX)
+        break;
+      continue; // skip unknown chunks
+    }
+
+    // a truncated last track is read up to the end of the file
+    lastTick = _midiProbeTrack(&probe, pos + 8, next != UINT32_MAX ? next : fileSize, pInfo, bDuration, iTrack++ == 0);
+    if (lastTick > pInfo->lengthTicks)
+      pInfo->lengthTicks = lastTick;
+    if (!bDuration || next == UINT32_MAX)
+      break; // the first track holds the name and the tempo, a truncated track is the last one
+  }
+
+  if (!bDuration)
+    pInfo->lengthTicks = 0;
+  else if (pInfo->PPQN && !(pInfo->PPQN & 0x8000)) { // no SMPTE time division
+    uint64_t time = probe.time + (uint64_t)(pInfo->lengthTicks - probe.tempoTick) * probe.usPerQuarter;
+    pInfo->durationUs = time / pInfo->PPQN;
+  }
+
+  pInfo->bytesRead = probe.bytesRead;
+  return true;
+}
+
+// Writes the note-offs of the pending notes, which end until dwEndTimePos, in time order. Then moves the track's
+// position to dwEndTimePos. With bFlushToEnd, all notes are ended and the position moves to the last note-off.
+bool	midiFileFlushTrack(MIDI_FILE* _pMFembedded, int32_t iTrack, bool bFlushToEnd, uint32_t dwEndTimePos) {
+  MIDI_FILE_TRACK* pTrack;
+  uint32_t cursor;
+
+  _VAR_CAST;
+  if (!(pTrack = _midiWriteTrack(pMFembedded, iTrack)))	return false;
+
+  cursor = pTrack->pos + pTrack->deltaTime;
+  while (_midiWriteNumNotes(pTrack)) {
+    MIDI_LAST_NOTE note = *_midiWriteNote(pMFembedded, pTrack, 0);
+    uint8_t msg[3] = { (uint8_t)(msgNoteOff | note.chn), note.note, 0 };
+
+    if (!bFlushToEnd && note.end_pos > dwEndTimePos)
+      break;
+    // the note's memory is free before the note-off is written, so it always fits
+    _midiWritePopNote(pMFembedded, pTrack);
+    pTrack->deltaTime = note.end_pos - pTrack->pos;
+    if (!_midiWriteEvent(pMFembedded, pTrack, msg, sizeof(msg), NULL, 0))
+      return false;
+  }
+  if (bFlushToEnd)
+    dwEndTimePos = pTrack->pos;
+
+  // events are never moved back in time
+  pTrack->deltaTime = (cursor > dwEndTimePos ? cursor : dwEndTimePos) - pTrack->pos;
+  return true;
+}
+
+bool	midiFileSyncTracks(MIDI_FILE* _pMFembedded, int32_t iTrack1, int32_t iTrack2) {
+  uint32_t p1, p2;
+
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))	return false;
+  if (!IsTrackValid(iTrack1))	return false;
+  if (!IsTrackValid(iTrack2))	return false;
+
+  p1 = pMFembedded->Track[iTrack1].pos + pMFembedded->Track[iTrack1].deltaTime;
+  p2 = pMFembedded->Track[iTrack2].pos + pMFembedded->Track[iTrack2].deltaTime;
+
+  if (p1 < p2)	return midiTrackIncTime(pMFembedded, iTrack1, p2 - p1, true);
+  if (p2 < p1)	return midiTrackIncTime(pMFembedded, iTrack2, p1 - p2, true);
+  return true;
+}
+
+static void _midiPutDword(uint8_t* pData, uint32_t value) {
+  pData[0] = (uint8_t)(value >> 24);
+  pData[1] = (uint8_t)(value >> 16);
+  pData[2] = (uint8_t)(value >> 8);
+  pData[3] = (uint8_t)value;
+}
+
+// Ends all used tracks and writes the file: the header, followed by the tracks in order. The size of every track
+// is known by now, so each one is written to its final position: first the data, which is still in the write
+// buffer, then the buffer is reused to copy the spilled segments.
+static bool _midiFileFinishWrite(_MIDI_FILE* pMidiFile) {
+  const MIDI_IO* pIo = pMidiFile->pIo;
+  const MIDI_IO* pSpillIo = pMidiFile->pSpillIo;
+  uint32_t trackPos[MAX_MIDI_TRACKS], pos = 14;
+  uint16_t numTracks = 0, version = pMidiFile->Header.iVersion;
+  uint8_t header[14];
+  bool bOk = true;
+  int32_t i;
+
+  for (i = 0; i < MAX_MIDI_TRACKS; ++i) {
+    MIDI_FILE_TRACK* pTrack = &pMidiFile->Track[i];
+
+    if (!pTrack->iBlockSize)
+      continue;
+    if (!pTrack->bEnded && !midiSongAddEndSequence(pMidiFile, i))
+      bOk = false;
+    trackPos[i] = pos;
+    pos += 8 + pTrack->sz;
+    numTracks++;
+  }
+  if (numTracks > 1 && version == 0)
+    version = 1;
+
+  memcpy(header, "MThd", 4);
+  _midiPutDword(header + 4, 6);
+  header[8] = (uint8_t)(version >> 8);
+  header[9] = (uint8_t)version;
+  header[10] = (uint8_t)(numTracks >> 8);
+  header[11] = (uint8_t)numTracks;
+  header[12] = (uint8_t)(pMidiFile->Header.PPQN >> 8);
+  header[13] = (uint8_t)pMidiFile->Header.PPQN;
+  if (pIo->write(pMidiFile->pIoContext, 0, header, 14) != 14)
+    bOk = false;
+
+  for (i = 0; i < MAX_MIDI_TRACKS; ++i) {
+    MIDI_FILE_TRACK* pTrack = &pMidiFile->Track[i];
+    uint32_t buffered = pTrack->ptrNew - pTrack->pBaseNew;
+
+    if (!pTrack->iBlockSize)
+      continue;
+    memcpy(header, "MTrk", 4);
+    _midiPutDword(header + 4, pTrack->sz);
+    if (pIo->write(pMidiFile->pIoContext, trackPos[i], header, 8) != 8 ||
+        pIo->write(pMidiFile->pIoContext, trackPos[i] + 8 + pTrack->sz - buffered, pMidiFile->cache.pBuffer + pTrack->pBaseNew, buffered) != buffered)
+      bOk = false;
+  }
+
+  for (i = 0; i < MAX_MIDI_TRACKS && pSpillIo; ++i) {
+    uint32_t segment = pMidiFile->Track[i].spillFirst, dst;
+
+    if (!pMidiFile->Track[i].iBlockSize)
+      continue;
+    dst = trackPos[i] + 8;
+    while (bOk && segment != SPILL_NONE) {
+      uint32_t segmentHeader[2], done, n;
+
+      if (pSpillIo->read(pMidiFile->pSpillContext, segment, segmentHeader, SPILL_HEADER_SIZE) != SPILL_HEADER_SIZE) {
+        bOk = false;
+        break;
+      }
+      for (done = 0; bOk && done < segmentHeader[1]; done += n, dst += n) {
+        n = segmentHeader[1] - done < pMidiFile->cache.size ? segmentHeader[1] - done : pMidiFile->cache.size;
+        bOk = pSpillIo->read(pMidiFile->pSpillContext, segment + SPILL_HEADER_SIZE + done, pMidiFile->cache.pBuffer, n) == n &&
+              pIo->write(pMidiFile->pIoContext, dst, pMidiFile->cache.pBuffer, n) == n;
+      }
+      segment = segmentHeader[0] ? segmentHeader[0] : SPILL_NONE;
+    }
+  }
+
+  return bOk;
+}
+
+bool	midiFileClose(MIDI_FILE* _pMFembedded) {
+  bool bWritten = true;
+
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))			return false;
+
+  if (pMFembedded->bOpenForWriting) {
+    bWritten = _midiFileFinishWrite(pMFembedded);
+    if (pMFembedded->pSpillIo && pMFembedded->pSpillIo->close)
+      pMFembedded->pSpillIo->close(pMFembedded->pSpillContext);
+    pMFembedded->pSpillIo = NULL;
+    pMFembedded->pSpillContext = NULL;
+    pMFembedded->bOpenForWriting = false;
+  }
+
+  cacheWaitPrefetch(pMFembedded);
+  if (pMFembedded->pMapped && pMFembedded->pIo && pMFembedded->pIo->unmap) // memory buffers belong to the caller
+    pMFembedded->pIo->unmap(pMFembedded->pIoContext, pMFembedded->pMapped, pMFembedded->file_sz);
+  pMFembedded->pMapped = NULL;
+  if (pMFembedded->cache.mode == cacheMapped)
+    pMFembedded->cache.mode = cacheSingleWindow;
+
+  if (pMFembedded->pIo) {
+    bool bClosed = pMFembedded->pIo->close ? pMFembedded->pIo->close(pMFembedded->pIoContext) : true;
+    pMFembedded->pIo = NULL;
+    pMFembedded->pIoContext = NULL;
+    return bClosed && bWritten;
+  }
   
+  return bWritten;
+}
+
+/*
+** midiSong* Functions
+*/
+bool	midiSongAddSMPTEOffset(MIDI_FILE* _pMFembedded, int32_t iTrack, int32_t iHours, int32_t iMins, int32_t iSecs, int32_t iFrames, int32_t iFFrames) {
+  uint8_t tmp[] = { msgMetaEvent, metaSMPTEOffset, 0x05, 0, 0, 0, 0, 0 };
+
+  if (iMins < 0 || iMins > 59) iMins = 0;
+  if (iSecs < 0 || iSecs > 59) iSecs = 0;
+  if (iFrames < 0 || iFrames > 24) iFrames = 0;
+
+  tmp[3] = (uint8_t)iHours;
+  tmp[4] = (uint8_t)iMins;
+  tmp[5] = (uint8_t)iSecs;
+  tmp[6] = (uint8_t)iFrames;
+  tmp[7] = (uint8_t)iFFrames;
+  return midiTrackAddRaw(_pMFembedded, iTrack, sizeof(tmp), tmp, false, 0);
+}
+
+bool	midiSongAddSimpleTimeSig(MIDI_FILE* _pMFembedded, int32_t iTrack, int32_t iNom, int32_t iDenom) {
+  return midiSongAddTimeSig(_pMFembedded, iTrack, iNom, iDenom, 24, 8);
+}
+
+// iDenom is a note length, i.e. MIDI_NOTE_CROCHET for 4/4
+bool	midiSongAddTimeSig(MIDI_FILE* _pMFembedded, int32_t iTrack, int32_t iNom, int32_t iDenom, int32_t iClockInMetroTick, int32_t iNotated32nds) {
+  uint8_t tmp[] = { msgMetaEvent, metaTimeSig, 0x04, 0, 0, 0, 0 };
+  int32_t power = 0;
+
+  if (iDenom <= 0)	return false;
+  while ((MIDI_NOTE_BREVE >> power) > iDenom)	// the file stores the denominator as a power of 2 (whole note = 0)
+    power++;
+
+  tmp[3] = (uint8_t)iNom;
+  tmp[4] = (uint8_t)power;
+  tmp[5] = (uint8_t)iClockInMetroTick;
+  tmp[6] = (uint8_t)iNotated32nds;
+  return midiTrackAddRaw(_pMFembedded, iTrack, sizeof(tmp), tmp, false, 0);
+}
+
+bool	midiSongAddKeySig(MIDI_FILE* _pMFembedded, int32_t iTrack, tMIDI_KEYSIG iKey) {
+  uint8_t tmp[] = { msgMetaEvent, metaKeySig, 0x02, 0, 0 };
+
+  tmp[3] = (uint8_t)((iKey & keyMaskKey) * ((iKey & keyMaskNeg) ? -1 : 1));
+  tmp[4] = (uint8_t)((iKey & keyMaskMin) ? 1 : 0);
+  return midiTrackAddRaw(_pMFembedded, iTrack, sizeof(tmp), tmp, false, 0);
+}
+
+// iTempo in beats per minute
+bool	midiSongAddTempo(MIDI_FILE* _pMFembedded, int32_t iTrack, int32_t iTempo) {
+  uint8_t tmp[] = { msgMetaEvent, metaSetTempo, 0x03, 0, 0, 0 };
+  uint32_t us;	// microseconds per quarter note
+
+  if (iTempo <= 0)	return false;
+  us = MICROSECONDS_PER_MINUTE / iTempo;
+  tmp[3] = (uint8_t)((us >> 16) & 0xff);
+  tmp[4] = (uint8_t)((us >> 8) & 0xff);
+  tmp[5] = (uint8_t)((us >> 0) & 0xff);
+  return midiTrackAddRaw(_pMFembedded, iTrack, sizeof(tmp), tmp, false, 0);
+}
+
+bool	midiSongAddMIDIPort(MIDI_FILE* _pMFembedded, int32_t iTrack, int32_t iPort) {
+  uint8_t tmp[] = { msgMetaEvent, metaMIDIPort, 1, 0 };
+
+  tmp[3] = (uint8_t)iPort;
+  return midiTrackAddRaw(_pMFembedded, iTrack, sizeof(tmp), tmp, false, 0);
+}
+
+// Ends the pending notes and the track, nothing can be added to it afterwards. midiFileClose() ends all tracks,
+// which are still open.
+bool	midiSongAddEndSequence(MIDI_FILE* _pMFembedded, int32_t iTrack) {
+  const uint8_t tmp[] = { msgMetaEvent, metaEndSequence, 0 };
+  MIDI_FILE_TRACK* pTrack;
+
+  _VAR_CAST;
+  if (!(pTrack = _midiWriteTrack(pMFembedded, iTrack)))	return false;
+  if (!midiFileFlushTrack(pMFembedded, iTrack, true, 0))	return false;
+  if (!_midiWriteEvent(pMFembedded, pTrack, tmp, sizeof(tmp), NULL, 0))	return false;
+
+  pTrack->bEnded = true;
+  return true;
+}
+
+/*
+** midiTrack* Functions
+*/
+
+// Writes a complete event (status and data, i.e. MIDI_MSG::dataEmbedded) at the track's position. With bMovePtr,
+// the position is advanced by iDeltaTime ticks first. The status byte is required, the writer applies running
+// status itself.
+bool	midiTrackAddRaw(MIDI_FILE* _pMFembedded, int32_t iTrack, int32_t iDataSize, const uint8_t *pData, bool bMovePtr, int32_t iDeltaTime) {
+  MIDI_FILE_TRACK* pTrack;
+
+  _VAR_CAST;
+  if (!pData || iDataSize <= 0 || !(pData[0] & 0x80))	return false;
+  if (!(pTrack = _midiWriteTrack(pMFembedded, iTrack)))	return false;
+  if (bMovePtr && iDeltaTime > 0 && !midiTrackIncTime(pMFembedded, iTrack, iDeltaTime, true))	return false;
+
+  if (iDataSize >= 2 && pData[0] == msgMetaEvent && pData[1] == metaEndSequence)
+    return midiSongAddEndSequence(pMFembedded, iTrack);
+  return _midiWriteEvent(pMFembedded, pTrack, pData, (uint32_t)iDataSize, NULL, 0);
+}
+
+// Writes an event of another file, which is open for reading (i.e. of midiReadGetNextMergedEvent()), at the track's
+// position. The payload of meta events and SysEx is copied in pieces, so it may be of any length. Fails without
+// writing anything, if the payload is cut off by the end of the file.
+bool	midiTrackCopyEvent(MIDI_FILE* _pMFembedded, int32_t iTrack, const MIDI_FILE* pInFile, const MIDI_EVENT* pEvent) {
+  MIDI_FILE_TRACK* pTrack;
+  MIDI_PAYLOAD payload;
+  const uint8_t* pMapped;
+  uint8_t header[2 + 4], data[64];
+  uint32_t headerSize = 0, pos, num;
+
+  _VAR_CAST;
+  if (!pEvent)	return false;
+  if (!(pTrack = _midiWriteTrack(pMFembedded, iTrack)))	return false;
+
+  if (pEvent->status < msgSysEx1) {
+    header[0] = pEvent->status;
+    header[1] = pEvent->data1 & 0x7f;
+    header[2] = pEvent->data2 & 0x7f;
+    // program change and channel pressure have a single data byte
+    return _midiWriteEvent(pMFembedded, pTrack, header, (pEvent->status & 0xe0) == 0xc0 ? 2 : 3, NULL, 0);
+  }
+  if (pEvent->status == msgMetaEvent && pEvent->data1 == metaEndSequence)
+    return midiSongAddEndSequence(pMFembedded, iTrack);
+
+  if (!midiReadGetEventPayload(pInFile, pEvent, &payload))	return false;
+  if (payload.size && midiReadGetPayloadData(pInFile, &payload, payload.size - 1, data, 1) != 1)
+    return false; // truncated file
+
+  header[headerSize++] = pEvent->status;
+  if (pEvent->status == msgMetaEvent)
+    header[headerSize++] = pEvent->data1;
+  if (!(num = _midiEncodeVarLen(&header[headerSize], payload.size)))	return false;
+  headerSize += num;
+
+  // without spill storage, the whole event must fit (the delta time takes up to 4 bytes)
+  if (!pMFembedded->pSpillIo && pTrack->pEndNew - pTrack->ptrNew < 4 + headerSize + payload.size)
+    return false;
+  if (!_midiWriteEvent(pMFembedded, pTrack, header, headerSize, NULL, 0))
+    return false;
+
+  if ((pMapped = midiReadGetPayloadPtr(pInFile, &payload)))
+    return _midiWriteData(pMFembedded, pTrack, pMapped, payload.size);
+  for (pos = 0; pos < payload.size; pos += num) {
+    if (!(num = midiReadGetPayloadData(pInFile, &payload, pos, data, sizeof(data))) ||
+        !_midiWriteData(pMFembedded, pTrack, data, num))
+      return false;
+  }
+  return true;
+}
+
+// Appends channel messages (MIDI_EVENT::status, data1 and data2) at their absolute ticks to the track, i.e. the
+// events of midiReadGetNextEvents(). The ticks must not decrease nor lie before the track's position; the
+// 'offset' and 'track' fields are ignored. The events are encoded by _midiEncodeEvent(), as all other writes, but
+// straight into the track's write buffer; pending notes of midiTrackAddNote() are ended in between.
+// Returns the number of events written, which is less than numEvents if an event is invalid or doesn't fit.
+int32_t midiTrackAddEvents(MIDI_FILE* _pMFembedded, int32_t iTrack, const MIDI_EVENT* pEvents, int32_t numEvents) {
+  MIDI_FILE_TRACK* pTrack;
+  uint8_t *pData, *pEnd;
+  int32_t i;
+
+  _VAR_CAST;
+  if (!pEvents)	return 0;
+  if (!(pTrack = _midiWriteTrack(pMFembedded, iTrack)))	return 0;
+
+  pData = pMFembedded->cache.pBuffer + pTrack->ptrNew;
+  pEnd = pMFembedded->cache.pBuffer + pTrack->pEndNew;
+  for (i = 0; i < numEvents; ++i) {
+    const MIDI_EVENT* pEvent = &pEvents[i];
+    uint8_t msg[3];
+    uint32_t num;
+
+    if (pEvent->status < msgNoteOff || pEvent->status >= msgSysEx1 || pEvent->tick < pTrack->pos + pTrack->deltaTime)
+      break;
+
+    // leave the loop for the rare cases: a pending note ends or the buffer is full
+    if ((_midiWriteNumNotes(pTrack) && _midiWriteNote(pMFembedded, pTrack, 0)->end_pos <= pEvent->tick) ||
+        pEnd - pData < MIDI_WRITE_MAX_HEADER) {
+      pTrack->sz += (uint32_t)(pData - (pMFembedded->cache.pBuffer + pTrack->ptrNew));
+      pTrack->ptrNew = (uint32_t)(pData - pMFembedded->cache.pBuffer);
+      if (!midiFileFlushTrack(pMFembedded, iTrack, false, pEvent->tick))
+        return i;
+      if (pTrack->pEndNew - pTrack->ptrNew < MIDI_WRITE_MAX_HEADER && !_midiWriteSpill(pMFembedded, pTrack))
+        return i;
+      pData = pMFembedded->cache.pBuffer + pTrack->ptrNew;
+      pEnd = pMFembedded->cache.pBuffer + pTrack->pEndNew;
+      if (pEnd - pData < MIDI_WRITE_MAX_HEADER)
+        return i;
+    }
+
+    msg[0] = pEvent->status;
+    msg[1] = pEvent->data1 & 0x7f;
+    msg[2] = pEvent->data2 & 0x7f;
+    // program change and channel pressure have a single data byte
+    if (!(num = _midiEncodeEvent(pMFembedded, pData, pEvent->tick - pTrack->pos, msg, (msg[0] & 0xe0) == 0xc0 ? 2 : 3,
+                                 &pTrack->last_status)))
+      break;
+
+    pData += num;
+    pTrack->pos = pEvent->tick;
+    pTrack->deltaTime = 0;
+  }
+
+  pTrack->sz += (uint32_t)(pData - (pMFembedded->cache.pBuffer + pTrack->ptrNew));
+  pTrack->ptrNew = (uint32_t)(pData - pMFembedded->cache.pBuffer);
+  return i;
+}
+
+// Moves the track's position on by iDeltaTime (a note length, or ticks with bOverridePPQN), ending the notes
+// meanwhile
+bool	midiTrackIncTime(MIDI_FILE* _pMFembedded, int32_t iTrack, int32_t iDeltaTime, bool bOverridePPQN) {
+  MIDI_FILE_TRACK* pTrack;
+
+  _VAR_CAST;
+  if (!(pTrack = _midiWriteTrack(pMFembedded, iTrack)))	return false;
+
+  return midiFileFlushTrack(pMFembedded, iTrack, false,
+                            pTrack->pos + pTrack->deltaTime + _midiGetLength(pMFembedded->Header.PPQN, iDeltaTime, bOverridePPQN));
+}
+
+bool	midiTrackAddText(MIDI_FILE* _pMFembedded, int32_t iTrack, tMIDI_TEXT iType, const char *pTxt) {
+  MIDI_FILE_TRACK* pTrack;
+  uint8_t event[2 + 4] = { msgMetaEvent, (uint8_t)iType };
+  uint32_t sz, num;
+
+  _VAR_CAST;
+  if (!pTxt)	return false;
+  if (!(pTrack = _midiWriteTrack(pMFembedded, iTrack)))	return false;
+
+  sz = (uint32_t)strlen(pTxt);
+  if (!(num = _midiEncodeVarLen(event + 2, sz)))	return false;
+  return _midiWriteEvent(pMFembedded, pTrack, event, 2 + num, pTxt, sz);
+}
+
+bool	midiTrackSetKeyPressure(MIDI_FILE* _pMFembedded, int32_t iTrack, int32_t iNote, int32_t iAftertouch) {
+  return midiTrackAddMsg(_pMFembedded, iTrack, msgNoteKeyPressure, iNote, iAftertouch);
+}
+
+bool	midiTrackAddControlChange(MIDI_FILE* _pMFembedded, int32_t iTrack, tMIDI_CC iCCType, int32_t iParam) {
+  return midiTrackAddMsg(_pMFembedded, iTrack, msgControlChange, iCCType, iParam);
+}
+
+bool	midiTrackAddProgramChange(MIDI_FILE* _pMFembedded, int32_t iTrack, int32_t iInstrPatch) {
+  return midiTrackAddMsg(_pMFembedded, iTrack, msgSetProgram, iInstrPatch, 0);
+}
+
+bool	midiTrackChangeKeyPressure(MIDI_FILE* _pMFembedded, int32_t iTrack, int32_t iDeltaPressure) {
+  return midiTrackAddMsg(_pMFembedded, iTrack, msgChangePressure, iDeltaPressure & 0x7f, 0);
+}
+
+// iWheelPos is -8192 to 8191
+bool	midiTrackSetPitchWheel(MIDI_FILE* _pMFembedded, int32_t iTrack, int32_t iWheelPos) {
+  uint16_t wheel = (uint16_t)(iWheelPos + MIDI_WHEEL_CENTRE);
+
+  // the wheel position is sent as two 7 bit values
+  return midiTrackAddMsg(_pMFembedded, iTrack, msgSetPitchWheel, wheel & 0x7f, (wheel >> 7) & 0x7f);
+}
+
+// Writes a channel message on the track's default channel
+bool	midiTrackAddMsg(MIDI_FILE* _pMFembedded, int32_t iTrack, tMIDI_MSG iMsg, int32_t iParam1, int32_t iParam2) {
+  MIDI_FILE_TRACK* pTrack;
+  uint8_t data[3];
+
+  _VAR_CAST;
+  if (!IsMessageValid(iMsg))	return false;
+  if (!(pTrack = _midiWriteTrack(pMFembedded, iTrack)))	return false;
+
+  data[0] = (uint8_t)(iMsg | pTrack->iDefaultChannel);
+  data[1] = (uint8_t)(iParam1 & 0x7f);
+  data[2] = (uint8_t)(iParam2 & 0x7f);
+  // program change and channel pressure have a single data byte
+  return _midiWriteEvent(pMFembedded, pTrack, data, iMsg == msgSetProgram || iMsg == msgChangePressure ? 2 : 3, NULL, 0);
+}
+
+// Starts a note of iLength (a note length, or ticks with bOverrideLength) at the track's position. Its note-off
+// is written, when the position passes its end (midiTrackIncTime(), midiFileFlushTrack()). With bAutoInc, the
+// position moves to the end of the note, otherwise following notes start at the same time (i.e. chords).
+bool	midiTrackAddNote(MIDI_FILE* _pMFembedded, int32_t iTrack, int32_t iNote, int32_t iLength, int32_t iVol, bool bAutoInc, bool bOverrideLength) {
+  MIDI_FILE_TRACK* pTrack;
+  MIDI_LAST_NOTE note;
+  uint8_t msg[3];
+
+  _VAR_CAST;
+  if (!IsNoteValid(iNote))	return false;
+  if (!(pTrack = _midiWriteTrack(pMFembedded, iTrack)))	return false;
+  // a note must end after it starts, its note-off is never written before the current position
+  if ((iLength = _midiGetLength(pMFembedded->Header.PPQN, iLength, bOverrideLength)) <= 0)	return false;
+
+  // the notes may take all of the track's part but MIDI_WRITE_MIN_BUFFER bytes for the data
+  if ((_midiWriteNumNotes(pTrack) + 1) * sizeof(MIDI_LAST_NOTE) + MIDI_WRITE_MIN_BUFFER > pTrack->iBlockSize)
+    return false; // too many notes at once
+  if (!pMFembedded->pSpillIo && pTrack->pEndNew - pTrack->ptrNew < sizeof(MIDI_LAST_NOTE) + 4 + sizeof(msg))
+    return false;
+
+  msg[0] = (uint8_t)(msgNoteOn | pTrack->iDefaultChannel);
+  msg[1] = (uint8_t)iNote;
+  msg[2] = (uint8_t)(iVol & 0x7f);
+  if (!_midiWriteEvent(pMFembedded, pTrack, msg, sizeof(msg), NULL, 0))
+    return false;
+
+  if (pTrack->pEndNew - pTrack->ptrNew < sizeof(MIDI_LAST_NOTE) && !_midiWriteSpill(pMFembedded, pTrack))
+    return false;
+  note.note = (uint8_t)iNote;
+  note.chn = pTrack->iDefaultChannel;
+  note.end_pos = pTrack->pos + iLength;
+  _midiWritePushNote(pMFembedded, pTrack, &note);
+
+  if (bAutoInc)
+    return midiTrackIncTime(pMFembedded, iTrack, iLength, true);
   return true;
 }
+
+bool	midiTrackAddRest(MIDI_FILE* _pMFembedded, int32_t iTrack, int32_t iLength, bool bOverridePPQN) {
+  return midiTrackIncTime(_pMFembedded, iTrack, iLength, bOverridePPQN);
+}
+
+// Returns the position of the last event written to the track
+uint32_t	midiTrackGetEndPos(const MIDI_FILE* _pMFembedded, int32_t iTrack) {
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))	return 0;
+  if (!IsTrackValid(iTrack))	return 0;
+
+  return pMFembedded->Track[iTrack].pos;
+}
@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include "midiinfo.h"		/* enumerations and constants for GM */
+#include "hal/hal_filesystem.h"
 
 /*
  * midiFile.c -  Header file for Steevs MIDI Library
@@ -43,7 +44,16 @@
 */
 
 // Cache
-#define PLAYBACK_CACHE_SIZE 10 * 1024 // 10KB cache
+#ifndef PLAYBACK_CACHE_SIZE
+#define PLAYBACK_CACHE_SIZE 10 * 1024 // 10KB built-in cache, may be reduced if all files get a cache buffer on opening
+#endif
+#define PLAYBACK_CACHE_MIN_WINDOW 64 // Smallest read-ahead window a track gets in per track mode
+#ifndef MIDI_CACHE_SECTOR_SIZE
+#define MIDI_CACHE_SECTOR_SIZE 512 // Sector size of the storage, for the sector aligned cache mode (power of 2)
+#endif
+
+// Writer
+#define MIDI_WRITE_MIN_BUFFER 32 // Smallest write buffer a track keeps, its pending notes of midiTrackAddNote() may take the rest
 
 // Embedded Constants
 #define META_EVENT_MAX_DATA_SIZE 128 // The meta event size must be at least 5 bytes long, to store: variable 4 byte length, 1 byte event id.
@@ -81,6 +91,72 @@ typedef struct {
   int32_t	iEndPos;
 } MIDI_END_POINT;
 
+// Read-ahead cache. Its memory is either the built-in buffer of PLAYBACK_CACHE_SIZE bytes or a buffer passed
+// to midiFileOpenCached(). In single window mode, all reads are served by one window over the whole cache.
+// In per track mode, the cache memory is split across all tracks of the file, so every track streams from its
+// own window and switching between tracks (format 1) does not discard the data of the other tracks.
+// In mapped mode, the file is not cached at all, but read straight from the memory mapping provided by the I/O backend.
+// Prefetch mode splits the cache like per track mode and double buffers every window: while one half is consumed,
+// the following data of the track is read into the other half in the background (MIDI_IO readAsync). Backends
+// without readAsync use per track mode instead; midiIoHal has it, if the library is built with MIDI_CACHE_PREFETCH.
+// The structures are the same either way, so objects built with and without the flag can be linked together.
+// Sector aligned mode splits the cache like per track mode, but in whole sectors of MIDI_CACHE_SECTOR_SIZE, and
+// refills start at a sector boundary. So a block device (i.e. FatFs) can read straight into the cache, without
+// copying through its own sector buffer. If a sector per track doesn't fit, a single aligned window is used.
+typedef enum {
+  cacheSingleWindow = 0,
+  cachePerTrack     = 1,
+  cacheMapped       = 2,
+  cachePrefetch     = 3,
+  cacheSectorAligned = 4,
+} tMIDI_CACHE_MODE;
+
+// Cache counters of a window, see midiFileGetCacheStats(). They are used to size the cache for a product.
+typedef struct {
+  uint32_t hits;            // requests served without touching the file
+  uint32_t misses;          // requests which needed a refill
+  uint32_t refills;         // reads from the I/O backend (or swaps of a background read in prefetch mode)
+  uint32_t seeks;           // refills, which didn't continue the data in the window
+  uint32_t bytesFetched;    // bytes read from the I/O backend
+  uint32_t largestRequest;  // largest single request to the cache, in bytes
+  uint32_t refillTimeUs;    // total time the reader waited for refills
+  uint32_t maxRefillTimeUs; // longest single wait
+  uint32_t eofReads;        // refills, which got no data: reads over the end of the file (truncated files)
+} MIDI_CACHE_STATS;
+
+// Called on every cache miss, after the window was refilled. iWindow is the track in per track mode, 0 otherwise.
+// cachePosOnReq and cacheSize describe the window before the refill, numAvailable is the number of bytes the refill
+// made available from reqStartPos on; 0 means the request was over the end of the file.
+typedef void(*OnCacheMissCallback_t)(void* pUserData, int32_t iWindow, uint32_t reqStartPos, uint32_t reqNumBytes, uint32_t cachePosOnReq, uint32_t cacheSize, uint32_t numAvailable);
+
+typedef struct {
+  uint32_t regionStart;   // first file position served by this window (track chunk start)
+  uint32_t regionEnd;     // file position behind the served region
+  uint8_t* pData;         // window memory, part of the cache buffer
+  uint32_t size;          // capacity of this window
+  uint32_t startPos;      // file position of pData[0]
+  uint32_t fill;          // number of valid bytes in pData, 0 = empty
+
+  MIDI_CACHE_STATS stats;
+
+  uint8_t* pNext;         // prefetch mode: second buffer of the window, filled in the background
+  HAL_ASYNC_READ request; // background read into pNext
+  bool bPrefetching;      // request is queued or done, but not yet consumed
+} MIDI_CACHE_WINDOW;
+
+typedef struct {
+  tMIDI_CACHE_MODE mode;
+  uint8_t* pBuffer;       // cache memory, data or a buffer of the caller
+  uint32_t size;
+  uint8_t data[PLAYBACK_CACHE_SIZE];
+  MIDI_CACHE_WINDOW window[MAX_MIDI_TRACKS];
+  int32_t numWindows;
+  int32_t lastWindow;     // window of the last request, checked first
+
+  OnCacheMissCallback_t pOnMissCb;
+  void* pOnMissUserData;
+} MIDI_CACHE;
+
 typedef struct 	{
   uint32_t ptrNew;
   uint32_t pBaseNew;
@@ -91,9 +167,14 @@ typedef struct 	{
   /* For Reading MIDI Files */
   uint32_t sz;						/* size of whole iTrack */
   /* For Writing MIDI Files */
-  uint32_t iBlockSize;				/* max size of track */
+  uint32_t iBlockSize;				/* size of the track's part of the write buffer, 0 while the track is unused */
+  uint32_t spillFirst;				/* spill storage positions of the first and last segment, UINT32_MAX if none */
+  uint32_t spillLast;
+  uint8_t iSlot;					/* index of the track's part of the write buffer */
+  bool bEnded;					/* End of Track was written */
   uint8_t iDefaultChannel;		/* use for write only */
   uint8_t last_status;				/* used for running status */
+  uint16_t eventFilter;				/* event types returned by the reader, see MIDI_FILTER_* */
 
   uint32_t debugLastClock;
   uint32_t debugLastMsgDt;
@@ -108,14 +189,40 @@ typedef struct 	{
   uint16_t	PPQN;			/* pulses per quarter note */
 } MIDI_HEADER;
 
+// Source of the file data. The reader accesses a file only through this interface, so different backends (stdio,
+// FatFs, a network stream, a compressed container, ...) can be used side by side in the same build. pContext is the
+// backend's handle, passed to midiFileOpenIo(). read and size are required, the other functions are optional (NULL).
+typedef struct {
+  uint32_t (*read)(void* pContext, uint32_t pos, void* dst, uint32_t numBytes); // returns the number of bytes read
+  uint32_t (*size)(void* pContext);
+  bool (*map)(void* pContext, const uint8_t** ppData, uint32_t* pSize); // maps the whole file read only
+  void (*unmap)(void* pContext, const uint8_t* pData, uint32_t size);
+  bool (*close)(void* pContext);
+  uint32_t (*write)(void* pContext, uint32_t pos, const void* src, uint32_t numBytes); // only used for writing
+  bool (*readAsync)(void* pContext, HAL_ASYNC_READ* pRequest); // queues a read, used in prefetch mode
+  uint32_t (*readWait)(void* pContext, HAL_ASYNC_READ* pRequest); // waits for it and returns the bytes read
+} MIDI_IO;
+
+// Backend on top of the hal_f* functions, its context is the FILE* of hal_fopen()
+extern const MIDI_IO midiIoHal;
+
 typedef struct {
-  FILE				*pFile;
+  const MIDI_IO			*pIo;
+  void				*pIoContext;
   bool				bOpenForWriting;
+  bool				bNoteOffAsNoteOn;	// writing: see midiFileSetNoteOffAsNoteOn()
+
+  MIDI_CACHE cache;
+  const uint8_t* pMapped;	// file mapping (if the HAL supports it) or the buffer of midiFileOpenFromMemory()
 
   MIDI_HEADER			Header;
   uint32_t file_sz;
   int32_t usPerTick; // microseconds per tick
 
+  const MIDI_IO			*pSpillIo;	// writing: storage for track data, which doesn't fit into the write buffer
+  void				*pSpillContext;
+  uint32_t spill_sz;
+
   MIDI_FILE_TRACK		Track[MAX_MIDI_TRACKS];
 } _MIDI_FILE;
 
@@ -128,7 +235,8 @@ typedef struct {
 
           int32_t		dt;		/* delta time */
           uint32_t		dwAbsPos;
-          uint32_t		iMsgSize;
+          uint32_t		iMsgSize;	/* bytes in dataEmbedded, truncated to META_EVENT_MAX_DATA_SIZE */
+          uint32_t		iMsgFullSize;	/* size of the event in the file, larger than iMsgSize if truncated */
 
           bool		bImpliedMsg;
           tMIDI_MSG	iImpliedMsg;
@@ -210,25 +318,149 @@ typedef struct {
   
         } MIDI_MSG;
 
+/*
+** Compact event record (12 bytes), an alternative to MIDI_MSG for lookahead buffers and bulk analysis.
+** Meta and SysEx payloads are not copied, 'offset' refers to the file instead.
+*/
+#define MIDI_EVENT_MAX_HEADER_SIZE 12 // delta time (4) + status (1) + meta type (1) + length (4), rounded up
+
+typedef struct {
+  uint32_t	tick;		/* absolute position in ticks */
+  uint32_t	offset;		/* channel events: file position of the data bytes, meta/SysEx: of the payload length */
+  uint8_t		status;		/* status byte incl. channel; 0xFF for meta events, 0xF0/0xF7 for SysEx */
+  uint8_t		data1;		/* 1st data byte, or the meta event type */
+  uint8_t		data2;		/* 2nd data byte */
+  uint8_t		track;		/* track the event was read from */
+} MIDI_EVENT;
+
+/*
+** Merged reader, see midiReadInitMerge(). It holds the next event of every track, ordered in a min-heap.
+*/
+typedef struct {
+  MIDI_EVENT	next[MAX_MIDI_TRACKS];	/* next event of each track */
+  uint64_t	heap[MAX_MIDI_TRACKS];	/* sort keys (tick, channel event flag, track) of the tracks with events left */
+  int32_t	num;			/* number of tracks with events left */
+} MIDI_MERGE;
+
+/*
+** Seek index, see midiFileBuildSeekIndex(). A checkpoint holds the reader state of a track just before an event.
+*/
+typedef struct {
+  uint32_t	tick;		/* absolute position of the track before the event */
+  uint32_t	offset;		/* file position of the event */
+  uint8_t		last_status;	/* running status at this point */
+} MIDI_SEEK_POINT;
+
+typedef struct {
+  MIDI_SEEK_POINT* pPoints;	/* caller provided storage, shared by all tracks */
+  uint32_t	maxPoints;
+  uint32_t	interval;	/* minimal distance of two checkpoints in ticks */
+  uint32_t	firstPoint[MAX_MIDI_TRACKS];
+  uint32_t	numPoints[MAX_MIDI_TRACKS];
+  uint32_t	lastTick;	/* absolute position of the last event of the file */
+} MIDI_SEEK_INDEX;
+
+/*
+** Tempo map, see midiFileBuildTempoMap(). Each point starts a section of constant tempo.
+*/
+#define MIDI_US_PER_QUARTER_DEFAULT (MICROSECONDS_PER_MINUTE / MIDI_BPM_DEFAULT)
+
+typedef struct {
+  uint32_t	tick;		/* absolute position, where the tempo changes */
+  uint32_t	usPerQuarter;	/* tempo from this position on */
+  uint64_t	time;		/* time at this position in 1/PPQN microseconds, so it is exact */
+} MIDI_TEMPO_POINT;
+
+typedef struct {
+  MIDI_TEMPO_POINT* pPoints;	/* caller provided storage, ascending by tick */
+  uint32_t	maxPoints;
+  uint32_t	numPoints;
+  uint16_t	PPQN;
+} MIDI_TEMPO_MAP;
+
+/*
+** File summary for catalogs, see midiFileProbe()
+*/
+#ifndef MIDI_PROBE_BUFFER_SIZE
+#define MIDI_PROBE_BUFFER_SIZE 256 // bytes read at once while probing, usually the header and the first events
+#endif
+
+typedef struct {
+  uint16_t	format;		/* 0, 1 or 2 */
+  uint16_t	numTracks;
+  uint16_t	PPQN;
+  uint32_t	usPerQuarter;	/* tempo at tick 0, MIDI_US_PER_QUARTER_DEFAULT if the file doesn't set one */
+  char		trackName[META_EVENT_MAX_DATA_SIZE];	/* name of the first track (usually the title), may be empty */
+  uint32_t	lengthTicks;	/* length of the longest track, only if the duration was requested */
+  uint64_t	durationUs;	/* length in microseconds, only if the duration was requested */
+  uint32_t	bytesRead;	/* number of bytes read from the file */
+} MIDI_FILE_INFO;
+
+/*
+** Event filter, see midiFileSetEventFilter(). Channel events map to bits 0 - 6 by their status nibble.
+*/
+#define MIDI_FILTER_NOTE_OFF          0x0001
+#define MIDI_FILTER_NOTE_ON           0x0002
+#define MIDI_FILTER_KEY_PRESSURE      0x0004
+#define MIDI_FILTER_CONTROL_CHANGE    0x0008
+#define MIDI_FILTER_PROGRAM           0x0010
+#define MIDI_FILTER_CHANNEL_PRESSURE  0x0020
+#define MIDI_FILTER_PITCH_WHEEL       0x0040
+#define MIDI_FILTER_META              0x0080
+#define MIDI_FILTER_SYSEX             0x0100
+#define MIDI_FILTER_ALL               0x01ff
+
+#define MIDI_FILTER_BIT(status) ((status) < msgSysEx1 ? 1 << (((status) >> 4) - 8) : \
+                                 (status) == msgMetaEvent ? MIDI_FILTER_META : MIDI_FILTER_SYSEX)
+
+// Handle of a meta or SysEx payload, the bytes stay in the file until they are fetched with midiReadGetPayloadData()
+typedef struct {
+  uint32_t	offset;		/* file position of the first payload byte */
+  uint32_t	size;		/* payload size in bytes, not truncated */
+} MIDI_PAYLOAD;
+
 /*
 ** midiFile* Prototypes
 */
-int32_t readChunkFromFile(FILE* pFile, void* dst, int32_t startPos, size_t num);
-int32_t readByteFromFile(FILE* pFile, uint8_t* dst, int32_t startPos);
-int32_t readWordFromFile(FILE* pFile, uint16_t* dst, int32_t startPos);
-int32_t readDwordFromFile(FILE* pFile, uint32_t* dst, int32_t startPos);
+int32_t readChunkFromFile(_MIDI_FILE* pMidiFile, void* dst, int32_t startPos, size_t num);
+int32_t readByteFromFile(_MIDI_FILE* pMidiFile, uint8_t* dst, int32_t startPos);
+int32_t readWordFromFile(_MIDI_FILE* pMidiFile, uint16_t* dst, int32_t startPos);
+int32_t readDwordFromFile(_MIDI_FILE* pMidiFile, uint32_t* dst, int32_t startPos);
 void setPlaybackTempo(_MIDI_FILE* pMidiFile, int32_t bpm);
 
 MIDI_FILE  *midiFileCreate(const char *pFilename, bool bOverwriteIfExists);
+MIDI_FILE  *midiFileCreateInstance(_MIDI_FILE *pMidiFile, const char *pFilename, bool bOverwriteIfExists);
+MIDI_FILE  *midiFileCreateIo(_MIDI_FILE *pMidiFile, const MIDI_IO *pIo, void *pContext, const MIDI_IO *pSpillIo, void *pSpillContext, void *pBuffer, uint32_t bufferSize);
 int32_t			midiFileSetTracksDefaultChannel(MIDI_FILE* _pMFembedded, int32_t iTrack, int32_t iChannel);
-int32_t			midiFileGetTracksDefaultChannel(MIDI_FILE* _pMFembedded, int32_t iTrack);
+int32_t			midiFileGetTracksDefaultChannel(const MIDI_FILE* _pMFembedded, int32_t iTrack);
 bool	  midiFileFlushTrack(MIDI_FILE* _pMFembedded, int32_t iTrack, bool bFlushToEnd, uint32_t dwEndTimePos);
 bool		midiFileSyncTracks(MIDI_FILE* _pMFembedded, int32_t iTrack1, int32_t iTrack2);
 int32_t			midiFileSetPPQN(MIDI_FILE* _pMFembedded, int32_t PPQN);
-int32_t			midiFileGetPPQN(MIDI_FILE* _pMFembedded);
+int32_t			midiFileGetPPQN(const MIDI_FILE* _pMFembedded);
+bool		midiFileSetNoteOffAsNoteOn(MIDI_FILE* _pMFembedded, bool bEnable);
 int32_t			midiFileSetVersion(MIDI_FILE* _pMFembedded, int32_t iVersion);
-int32_t			midiFileGetVersion(MIDI_FILE* _pMFembedded);
+int32_t			midiFileGetVersion(const MIDI_FILE* _pMFembedded);
 MIDI_FILE  *midiFileOpen(const char *pFilename);
+MIDI_FILE  *midiFileOpenInstance(_MIDI_FILE *pMidiFile, const char *pFilename);
+MIDI_FILE  *midiFileOpenFromMemory(_MIDI_FILE *pMidiFile, const void *pData, uint32_t size);
+MIDI_FILE  *midiFileOpenIo(_MIDI_FILE *pMidiFile, const MIDI_IO *pIo, void *pContext);
+MIDI_FILE  *midiFileOpenCached(_MIDI_FILE *pMidiFile, const char *pFilename, void *pCache, uint32_t cacheSize);
+MIDI_FILE  *midiFileOpenIoCached(_MIDI_FILE *pMidiFile, const MIDI_IO *pIo, void *pContext, void *pCache, uint32_t cacheSize);
+void		midiFileSetCacheMode(MIDI_FILE* _pMFembedded, tMIDI_CACHE_MODE mode);
+float		midiFileGetCacheHitRatio(const MIDI_FILE* _pMFembedded, int32_t iTrack);
+void		midiFileGetCacheStats(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_CACHE_STATS* pStats);
+void		midiFileResetCacheStats(MIDI_FILE* _pMFembedded);
+void		midiFileSetCacheMissCallback(MIDI_FILE* _pMFembedded, OnCacheMissCallback_t pOnMissCb, void* pUserData);
+void		midiFileSetEventFilter(MIDI_FILE* _pMFembedded, int32_t iTrack, uint16_t filter);
+bool		midiFileBuildSeekIndex(MIDI_FILE* _pMFembedded, MIDI_SEEK_INDEX* pIndex, MIDI_SEEK_POINT* pPoints, uint32_t maxPoints, uint32_t interval);
+bool		midiFileSeek(MIDI_FILE* _pMFembedded, const MIDI_SEEK_INDEX* pIndex, uint32_t tick);
+bool		midiFileRewindTrack(MIDI_FILE* _pMFembedded, int32_t iTrack);
+bool		midiFileBuildTempoMap(MIDI_FILE* _pMFembedded, MIDI_TEMPO_MAP* pMap, MIDI_TEMPO_POINT* pPoints, uint32_t maxPoints);
+uint64_t midiTempoMapTickToUs(const MIDI_TEMPO_MAP* pMap, uint32_t tick);
+uint32_t midiTempoMapUsToTick(const MIDI_TEMPO_MAP* pMap, uint64_t us);
+uint32_t midiTempoMapGetTempo(const MIDI_TEMPO_MAP* pMap, uint32_t tick);
+bool		midiFileProbe(const char* pFilename, MIDI_FILE_INFO* pInfo, bool bDuration);
+bool		midiFileProbeIo(const MIDI_IO* pIo, void* pContext, MIDI_FILE_INFO* pInfo, bool bDuration);
 bool		midiFileClose(MIDI_FILE* _pMFembedded);
 
 /*
@@ -246,17 +478,19 @@ bool		midiSongAddEndSequence(MIDI_FILE* _pMFembedded, int32_t iTrack);
 ** midiTrack* Prototypes
 */
 bool		midiTrackAddRaw(MIDI_FILE* _pMFembedded, int32_t iTrack, int32_t iDataSize, const uint8_t *pData, bool bMovePtr, int32_t iDeltaTime);
+bool		midiTrackCopyEvent(MIDI_FILE* _pMFembedded, int32_t iTrack, const MIDI_FILE* pInFile, const MIDI_EVENT* pEvent);
 bool		midiTrackIncTime(MIDI_FILE* _pMFembedded, int32_t iTrack, int32_t iDeltaTime, bool bOverridePPQN);
 bool		midiTrackAddText(MIDI_FILE* _pMFembedded, int32_t iTrack, tMIDI_TEXT iType, const char *pTxt);
 bool		midiTrackAddMsg(MIDI_FILE* _pMFembedded, int32_t iTrack, tMIDI_MSG iMsg, int32_t iParam1, int32_t iParam2);
+int32_t midiTrackAddEvents(MIDI_FILE* _pMFembedded, int32_t iTrack, const MIDI_EVENT* pEvents, int32_t numEvents);
 bool		midiTrackSetKeyPressure(MIDI_FILE* _pMFembedded, int32_t iTrack, int32_t iNote, int32_t iAftertouch);
 bool		midiTrackAddControlChange(MIDI_FILE* _pMFembedded, int32_t iTrack, tMIDI_CC iCCType, int32_t iParam);
 bool		midiTrackAddProgramChange(MIDI_FILE* _pMFembedded, int32_t iTrack, int32_t iInstrPatch);
-bool		midiTrackChangeKeyPressure(MIDI_FILE *pMF, MIDI_FILE* _pMFembedded,  int32_t iTrack, int32_t iDeltaPressure);
+bool		midiTrackChangeKeyPressure(MIDI_FILE* _pMFembedded, int32_t iTrack, int32_t iDeltaPressure);
 bool		midiTrackSetPitchWheel(MIDI_FILE* _pMFembedded, int32_t iTrack, int32_t iWheelPos);
 bool		midiTrackAddNote(MIDI_FILE* _pMFembedded, int32_t iTrack, int32_t iNote, int32_t iLength, int32_t iVol, bool bAutoInc, bool bOverrideLength);
 bool		midiTrackAddRest(MIDI_FILE* _pMFembedded, int32_t iTrack, int32_t iLength, bool bOverridePPQN);
-bool		midiTrackGetEndPos(MIDI_FILE* _pMFembedded, int32_t iTrack);
+uint32_t	midiTrackGetEndPos(const MIDI_FILE* _pMFembedded, int32_t iTrack);
 
 /*
 ** midiRead* Prototypes
@@ -264,6 +498,14 @@ bool		midiTrackGetEndPos(MIDI_FILE* _pMFembedded, int32_t iTrack);
 int32_t midiReadGetNumTracks(const MIDI_FILE* _pMFembedded);
 bool		midiReadGetNextMessage(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_MSG* pMsgEmbedded);
 void midiReadInitMessage(MIDI_MSG *pMsg);
+bool		midiReadGetNextEvent(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_EVENT* pEvent);
+int32_t midiReadGetNextEvents(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_EVENT* pEvents, int32_t maxEvents);
+bool		midiReadGetEventPayload(const MIDI_FILE* _pMFembedded, const MIDI_EVENT* pEvent, MIDI_PAYLOAD* pPayload);
+uint32_t midiReadGetPayloadData(const MIDI_FILE* _pMFembedded, const MIDI_PAYLOAD* pPayload, uint32_t pos, void* dst, uint32_t num);
+const uint8_t* midiReadGetPayloadPtr(const MIDI_FILE* _pMFembedded, const MIDI_PAYLOAD* pPayload);
+bool		midiReadEventToMessage(const MIDI_FILE* _pMFembedded, const MIDI_EVENT* pEvent, MIDI_MSG* pMsgEmbedded);
+bool		midiReadInitMerge(MIDI_FILE* _pMFembedded, MIDI_MERGE* pMerge);
+bool		midiReadGetNextMergedEvent(MIDI_FILE* _pMFembedded, MIDI_MERGE* pMerge, MIDI_EVENT* pEvent);
 
 
 #endif /* _MIDIFILE_H */
@@ -38,91 +38,146 @@
 #include "midiplayer.h"
 #include "hal/hal_misc.h"
 
+// Returns the payload of a text, sequencer specific or SysEx event. Mapped files hand out a pointer to the complete
+// payload, otherwise it is copied into the player and truncated to META_EVENT_MAX_DATA_SIZE bytes.
+static const uint8_t* fetchPayload(MIDI_PLAYER* pMidiPlayer, const MIDI_EVENT* pEvent, uint32_t* pSize, bool bText) {
+  MIDI_PAYLOAD payload;
+  const uint8_t* pData;
+
+  if (!midiReadGetEventPayload(pMidiPlayer->pMidiFile, pEvent, &payload))
+    return NULL;
+
+  *pSize = payload.size;
+  if (!bText && (pData = midiReadGetPayloadPtr(pMidiPlayer->pMidiFile, &payload)))
+    return pData;
+
+  *pSize = midiReadGetPayloadData(pMidiPlayer->pMidiFile, &payload, 0, pMidiPlayer->payload, META_EVENT_MAX_DATA_SIZE);
+  pMidiPlayer->payload[*pSize] = '\0'; // Add Null terminator
+  return pMidiPlayer->payload;
+}
+
+// Hands the payload to the chunk callback piece by piece, so payloads of any size need only the player buffer.
+// Mapped files are streamed without a copy.
+static void streamPayload(MIDI_PLAYER* pMidiPlayer, const MIDI_EVENT* pEvent, OnPayloadChunkCallback_t pChunkCb) {
+  MIDI_PAYLOAD payload;
+  const uint8_t* pMapped;
+  uint32_t pos = 0;
+
+  if (!midiReadGetEventPayload(pMidiPlayer->pMidiFile, pEvent, &payload))
+    return;
+
+  pMapped = midiReadGetPayloadPtr(pMidiPlayer->pMidiFile, &payload);
+  do {
+    uint32_t size = payload.size - pos < META_EVENT_MAX_DATA_SIZE ? payload.size - pos : META_EVENT_MAX_DATA_SIZE;
+
+    if (pMapped) {
+      pChunkCb(pEvent->track, pEvent->tick, &pMapped[pos], size, pos, payload.size);
+    }
+    else {
+      size = midiReadGetPayloadData(pMidiPlayer->pMidiFile, &payload, pos, pMidiPlayer->payload, size);
+      if (!size && payload.size)
+        break; // truncated file
+      pChunkCb(pEvent->track, pEvent->tick, pMidiPlayer->payload, size, pos, payload.size);
+    }
+    pos += size;
+  } while (pos < payload.size);
+}
+
+static void dispatchTextEvent(MIDI_PLAYER* pMidiPlayer, int32_t trackIndex, OnMetaTextEventCallback_t pTextCb) {
+  const MIDI_EVENT* pEvent = &pMidiPlayer->event[trackIndex];
+  uint32_t size;
+
+  if (pTextCb && fetchPayload(pMidiPlayer, pEvent, &size, true))
+    pTextCb(trackIndex, pEvent->tick, (char*)pMidiPlayer->payload);
+}
+
+// Channel events are dispatched straight from the compact event. The payload of meta and SysEx events is only
+// fetched, if a callback is registered for them (or it is needed for playback, like the tempo).
 static void dispatchMidiMsg(MIDI_PLAYER* pMidiPlayer, int32_t trackIndex) {
-  MIDI_MSG* msg = &pMidiPlayer->msg[trackIndex];
+  const MIDI_EVENT* pEvent = &pMidiPlayer->event[trackIndex];
+  int32_t iChannel = (pEvent->status & 0x0f) + 1;
+  MIDI_MSG* msg = &pMidiPlayer->msg;
+  const uint8_t* pData;
+  uint32_t size;
 
-  int32_t eventType = msg->bImpliedMsg ? msg->iImpliedMsg : msg->iType;
+  int32_t eventType = pEvent->status < msgSysEx1 ? (pEvent->status & 0xf0) : pEvent->status;
   switch (eventType) {
     case	msgNoteOff:
       if (pMidiPlayer->pOnNoteOffCb)
-        pMidiPlayer->pOnNoteOffCb(trackIndex, msg->dwAbsPos, msg->MsgData.NoteOff.iChannel, msg->MsgData.NoteOff.iNote);
+        pMidiPlayer->pOnNoteOffCb(trackIndex, pEvent->tick, iChannel, pEvent->data1);
       break;
     case	msgNoteOn:
       if (pMidiPlayer->pOnNoteOnCb)
-        pMidiPlayer->pOnNoteOnCb(trackIndex, msg->dwAbsPos, msg->MsgData.NoteOn.iChannel, msg->MsgData.NoteOn.iNote, msg->MsgData.NoteOn.iVolume);
+        pMidiPlayer->pOnNoteOnCb(trackIndex, pEvent->tick, iChannel, pEvent->data1, pEvent->data2);
       break;
     case	msgNoteKeyPressure:
       if (pMidiPlayer->pOnNoteKeyPressureCb)
-        pMidiPlayer->pOnNoteKeyPressureCb(trackIndex, msg->dwAbsPos, msg->MsgData.NoteKeyPressure.iChannel, msg->MsgData.NoteKeyPressure.iNote, msg->MsgData.NoteKeyPressure.iPressure);
+        pMidiPlayer->pOnNoteKeyPressureCb(trackIndex, pEvent->tick, iChannel, pEvent->data1, pEvent->data2);
       break;
     case	msgControlChange:
       if (pMidiPlayer->pOnSetParameterCb)
-        pMidiPlayer->pOnSetParameterCb(trackIndex, msg->dwAbsPos, msg->MsgData.NoteParameter.iChannel, msg->MsgData.NoteParameter.iControl, msg->MsgData.NoteParameter.iParam);
+        pMidiPlayer->pOnSetParameterCb(trackIndex, pEvent->tick, iChannel, pEvent->data1, pEvent->data2);
       break;
     case	msgSetProgram:
       if (pMidiPlayer->pOnSetProgramCb)
-        pMidiPlayer->pOnSetProgramCb(trackIndex, msg->dwAbsPos, msg->MsgData.ChangeProgram.iChannel, msg->MsgData.ChangeProgram.iProgram);
+        pMidiPlayer->pOnSetProgramCb(trackIndex, pEvent->tick, iChannel, pEvent->data1);
       break;
     case	msgChangePressure:
       if (pMidiPlayer->pOnChangePressureCb)
-        pMidiPlayer->pOnChangePressureCb(trackIndex, msg->dwAbsPos, msg->MsgData.ChangePressure.iChannel, msg->MsgData.ChangePressure.iPressure);
+        pMidiPlayer->pOnChangePressureCb(trackIndex, pEvent->tick, iChannel, pEvent->data1);
       break;
     case	msgSetPitchWheel:
       if (pMidiPlayer->pOnSetPitchWheelCb)
-        pMidiPlayer->pOnSetPitchWheelCb(trackIndex, msg->dwAbsPos, msg->MsgData.PitchWheel.iChannel, msg->MsgData.PitchWheel.iPitch + 8192);
+        pMidiPlayer->pOnSetPitchWheelCb(trackIndex, pEvent->tick, iChannel, pEvent->data1 | (pEvent->data2 << 7));
       break;
     case	msgMetaEvent:
-      switch (msg->MsgData.MetaEvent.iType) {
+      switch (pEvent->data1) {
       case	metaMIDIPort:
-        if (pMidiPlayer->pOnMetaMIDIPortCb)
-          pMidiPlayer->pOnMetaMIDIPortCb(trackIndex, msg->dwAbsPos, msg->MsgData.MetaEvent.Data.iMIDIPort);
+        if (pMidiPlayer->pOnMetaMIDIPortCb && midiReadEventToMessage(pMidiPlayer->pMidiFile, pEvent, msg))
+          pMidiPlayer->pOnMetaMIDIPortCb(trackIndex, pEvent->tick, msg->MsgData.MetaEvent.Data.iMIDIPort);
         break;
       case	metaSequenceNumber:
-        if (pMidiPlayer->pOnMetaSequenceNumberCb)
-          pMidiPlayer->pOnMetaSequenceNumberCb(trackIndex, msg->dwAbsPos, msg->MsgData.MetaEvent.Data.iSequenceNumber);
+        if (pMidiPlayer->pOnMetaSequenceNumberCb && midiReadEventToMessage(pMidiPlayer->pMidiFile, pEvent, msg))
+          pMidiPlayer->pOnMetaSequenceNumberCb(trackIndex, pEvent->tick, msg->MsgData.MetaEvent.Data.iSequenceNumber);
         break;
       case	metaTextEvent:
-        if (pMidiPlayer->pOnMetaTextEventCb)
-          pMidiPlayer->pOnMetaTextEventCb(trackIndex, msg->dwAbsPos, msg->MsgData.MetaEvent.Data.Text.pData);
+        dispatchTextEvent(pMidiPlayer, trackIndex, pMidiPlayer->pOnMetaTextEventCb);
         break;
       case	metaCopyright:
-        if (pMidiPlayer->pOnMetaCopyrightCb)
-          pMidiPlayer->pOnMetaCopyrightCb(trackIndex, msg->dwAbsPos, msg->MsgData.MetaEvent.Data.Text.pData);
+        dispatchTextEvent(pMidiPlayer, trackIndex, pMidiPlayer->pOnMetaCopyrightCb);
         break;
       case	metaTrackName:
-        if (pMidiPlayer->pOnMetaTrackNameCb)
-          pMidiPlayer->pOnMetaTrackNameCb(trackIndex, msg->dwAbsPos, msg->MsgData.MetaEvent.Data.Text.pData);
+        dispatchTextEvent(pMidiPlayer, trackIndex, pMidiPlayer->pOnMetaTrackNameCb);
         break;
       case	metaInstrument:
-        if (pMidiPlayer->pOnMetaInstrumentCb)
-          pMidiPlayer->pOnMetaInstrumentCb(trackIndex, msg->dwAbsPos, msg->MsgData.MetaEvent.Data.Text.pData);
+        dispatchTextEvent(pMidiPlayer, trackIndex, pMidiPlayer->pOnMetaInstrumentCb);
         break;
       case	metaLyric:
-        if (pMidiPlayer->pOnMetaLyricCb)
-          pMidiPlayer->pOnMetaLyricCb(trackIndex, msg->dwAbsPos, msg->MsgData.MetaEvent.Data.Text.pData);
+        dispatchTextEvent(pMidiPlayer, trackIndex, pMidiPlayer->pOnMetaLyricCb);
         break;
       case	metaMarker:
-        if (pMidiPlayer->pOnMetaMarkerCb)
-          pMidiPlayer->pOnMetaMarkerCb(trackIndex, msg->dwAbsPos, msg->MsgData.MetaEvent.Data.Text.pData);
+        dispatchTextEvent(pMidiPlayer, trackIndex, pMidiPlayer->pOnMetaMarkerCb);
         break;
       case	metaCuePoint:
-        if (pMidiPlayer->pOnMetaCuePointCb)
-          pMidiPlayer->pOnMetaCuePointCb(trackIndex, msg->dwAbsPos, msg->MsgData.MetaEvent.Data.Text.pData);
+        dispatchTextEvent(pMidiPlayer, trackIndex, pMidiPlayer->pOnMetaCuePointCb);
         break;
       case	metaEndSequence:
         if (pMidiPlayer->pOnMetaEndSequenceCb)
-          pMidiPlayer->pOnMetaEndSequenceCb(trackIndex, msg->dwAbsPos);
+          pMidiPlayer->pOnMetaEndSequenceCb(trackIndex, pEvent->tick);
         break;
       case	metaSetTempo:
+        if (!midiReadEventToMessage(pMidiPlayer->pMidiFile, pEvent, msg))
+          break;
         setPlaybackTempo(pMidiPlayer->pMidiFile, msg->MsgData.MetaEvent.Data.Tempo.iBPM);
-        adjustTimeFactor(pMidiPlayer);
+        if (!pMidiPlayer->pTempoMap)
+          adjustTimeFactor(pMidiPlayer);
 
         if (pMidiPlayer->pOnMetaSetTempoCb)
-          pMidiPlayer->pOnMetaSetTempoCb(trackIndex, msg->dwAbsPos, msg->MsgData.MetaEvent.Data.Tempo.iBPM);
+          pMidiPlayer->pOnMetaSetTempoCb(trackIndex, pEvent->tick, msg->MsgData.MetaEvent.Data.Tempo.iBPM);
         break;
       case	metaSMPTEOffset:
-        if (pMidiPlayer->pOnMetaSMPTEOffsetCb)
-          pMidiPlayer->pOnMetaSMPTEOffsetCb(trackIndex, msg->dwAbsPos,
+        if (pMidiPlayer->pOnMetaSMPTEOffsetCb && midiReadEventToMessage(pMidiPlayer->pMidiFile, pEvent, msg))
+          pMidiPlayer->pOnMetaSMPTEOffsetCb(trackIndex, pEvent->tick,
             msg->MsgData.MetaEvent.Data.SMPTE.iHours,
             msg->MsgData.MetaEvent.Data.SMPTE.iMins,
             msg->MsgData.MetaEvent.Data.SMPTE.iSecs,
@@ -132,31 +187,33 @@ static void dispatchMidiMsg(MIDI_PLAYER* pMidiPlayer, int32_t trackIndex) {
         break;
       case	metaTimeSig:
         // TODO: Metronome and thirtyseconds are missing!!!
-        if (pMidiPlayer->pOnMetaTimeSigCb)
+        if (pMidiPlayer->pOnMetaTimeSigCb && midiReadEventToMessage(pMidiPlayer->pMidiFile, pEvent, msg))
           pMidiPlayer->pOnMetaTimeSigCb(trackIndex,
-            msg->dwAbsPos,
+            pEvent->tick,
             msg->MsgData.MetaEvent.Data.TimeSig.iNom,
             msg->MsgData.MetaEvent.Data.TimeSig.iDenom / MIDI_NOTE_CROCHET,
             0, 0
           );
         break;
       case	metaKeySig: // TODO: scale is missing!!!
-        if (pMidiPlayer->pOnMetaKeySigCb)
-          pMidiPlayer->pOnMetaKeySigCb(trackIndex, msg->dwAbsPos, msg->MsgData.MetaEvent.Data.KeySig.iKey, 0);
+        if (pMidiPlayer->pOnMetaKeySigCb && midiReadEventToMessage(pMidiPlayer->pMidiFile, pEvent, msg))
+          pMidiPlayer->pOnMetaKeySigCb(trackIndex, pEvent->tick, msg->MsgData.MetaEvent.Data.KeySig.iKey, 0);
         break;
       case	metaSequencerSpecific:
-        if (pMidiPlayer->pOnMetaSequencerSpecificCb)
-          pMidiPlayer->pOnMetaSequencerSpecificCb(trackIndex, msg->dwAbsPos,
-            msg->MsgData.MetaEvent.Data.Sequencer.pData, msg->MsgData.MetaEvent.Data.Sequencer.iSize
-          );
+        if (pMidiPlayer->pOnSequencerSpecificChunkCb)
+          streamPayload(pMidiPlayer, pEvent, pMidiPlayer->pOnSequencerSpecificChunkCb);
+        else if (pMidiPlayer->pOnMetaSequencerSpecificCb && (pData = fetchPayload(pMidiPlayer, pEvent, &size, false)))
+          pMidiPlayer->pOnMetaSequencerSpecificCb(trackIndex, pEvent->tick, (void*)pData, size);
         break;
       }
       break;
 
     case	msgSysEx1:
     case	msgSysEx2:
-      if (pMidiPlayer->pOnMetaSysExCb)
-        pMidiPlayer->pOnMetaSysExCb(trackIndex, msg->dwAbsPos, msg->MsgData.SysEx.pData, msg->MsgData.SysEx.iSize);
+      if (pMidiPlayer->pOnSysExChunkCb)
+        streamPayload(pMidiPlayer, pEvent, pMidiPlayer->pOnSysExChunkCb);
+      else if (pMidiPlayer->pOnMetaSysExCb && (pData = fetchPayload(pMidiPlayer, pEvent, &size, false)))
+        pMidiPlayer->pOnMetaSysExCb(trackIndex, pEvent->tick, (void*)pData, size);
       break;
     }
 }
@@ -198,6 +255,58 @@ void midiplayer_init(MIDI_PLAYER* mpl, OnNoteOffCallback_t pOnNoteOffCb, OnNoteO
   mpl->pOnMetaKeySigCb = pOnMetaKeySigCb;
   mpl->pOnMetaSequencerSpecificCb = pOnMetaSequencerSpecificCb;
   mpl->pOnMetaSysExCb = pOnMetaSysExCb;
+  mpl->eventFilter = MIDI_FILTER_ALL;
+  mpl->sequence = -1;
+  mpl->pSequenceChain = NULL;
+}
+
+void midiPlayerSetChunkCallbacks(MIDI_PLAYER* mpl, OnPayloadChunkCallback_t pOnSysExChunkCb,
+    OnPayloadChunkCallback_t pOnSequencerSpecificChunkCb) {
+  mpl->pOnSysExChunkCb = pOnSysExChunkCb;
+  mpl->pOnSequencerSpecificChunkCb = pOnSequencerSpecificChunkCb;
+}
+
+// Events, which are filtered out, are skipped by the reader. Takes effect with the next file.
+void midiPlayerSetEventFilter(MIDI_PLAYER* mpl, uint16_t filter) {
+  mpl->eventFilter = filter;
+}
+
+// Starts a format 2 sequence from its beginning. lateUs is the time, the previous sequence ended before now, so
+// chained sequences follow each other without a gap.
+static void startSequence(MIDI_PLAYER* pMidiPlayer, int32_t iTrack, int32_t lateUs) {
+  midiFileRewindTrack(pMidiPlayer->pMidiFile, iTrack);
+  pMidiPlayer->eventPending[iTrack] = midiReadGetNextEvent(pMidiPlayer->pMidiFile, iTrack, &pMidiPlayer->event[iTrack]);
+  pMidiPlayer->pMidiFile->Track[iTrack].deltaTime = pMidiPlayer->event[iTrack].tick;
+
+  setPlaybackTempo(pMidiPlayer->pMidiFile, MIDI_BPM_DEFAULT);
+  pMidiPlayer->lastUsPerTick = pMidiPlayer->pMidiFile->usPerTick;
+  pMidiPlayer->sequence = iTrack;
+  pMidiPlayer->startTime = hal_clock() * 1000 - lateUs;
+  pMidiPlayer->startTick = 0;
+  pMidiPlayer->currentTick = 0;
+  pMidiPlayer->lastTick = 0;
+}
+
+// Starts the sequence after the current one: the next of the chain, or the next track without a chain.
+static bool nextSequence(MIDI_PLAYER* pMidiPlayer) {
+  MIDI_FILE_TRACK* pTrack = &pMidiPlayer->pMidiFile->Track[pMidiPlayer->sequence];
+  int32_t lateUs = pTrack->deltaTime < 0 ? -pTrack->deltaTime * pMidiPlayer->pMidiFile->usPerTick : 0;
+  int32_t next = pMidiPlayer->sequence + 1;
+
+  if (pMidiPlayer->pSequenceChain) {
+    if (pMidiPlayer->chainPos >= pMidiPlayer->chainLength) {
+      if (!pMidiPlayer->bLoopChain || !pMidiPlayer->chainLength)
+        return false;
+      pMidiPlayer->chainPos = 0;
+    }
+    next = pMidiPlayer->pSequenceChain[pMidiPlayer->chainPos++];
+  }
+
+  if (next >= midiReadGetNumTracks(pMidiPlayer->pMidiFile))
+    return false;
+
+  startSequence(pMidiPlayer, next, lateUs);
+  return true;
 }
 
 bool midiPlayerOpenFile(MIDI_PLAYER* pMidiPlayer, const char* pFileName) {
@@ -205,19 +314,84 @@ bool midiPlayerOpenFile(MIDI_PLAYER* pMidiPlayer, const char* pFileName) {
   if (!pMidiPlayer->pMidiFile)
     return false;
   
-  // Load initial midi events
-  for (int iTrack = 0; iTrack < midiReadGetNumTracks(pMidiPlayer->pMidiFile); iTrack++) {
-    midiReadGetNextMessage(pMidiPlayer->pMidiFile, iTrack, &pMidiPlayer->msg[iTrack]);
-    pMidiPlayer->pMidiFile->Track[iTrack].deltaTime = pMidiPlayer->msg[iTrack].dt;
-  }
+  midiFileSetEventFilter(pMidiPlayer->pMidiFile, -1, pMidiPlayer->eventFilter | MIDI_FILTER_META); // keep tempo changes
 
   pMidiPlayer->startTime = hal_clock() * 1000;
+  pMidiPlayer->startTick = 0;
   pMidiPlayer->currentTick = 0;
   pMidiPlayer->lastTick = 0;
+  pMidiPlayer->pTempoMap = NULL;
   pMidiPlayer->trackIsFinished = true;
   pMidiPlayer->allTracksAreFinished = false;
   pMidiPlayer->lastUsPerTick = pMidiPlayer->pMidiFile->usPerTick;
+  pMidiPlayer->sequence = -1;
+  pMidiPlayer->chainPos = 0;
 
+  if (pMidiPlayer->pMidiFile->Header.iVersion == 2) {
+    int32_t first = pMidiPlayer->pSequenceChain && pMidiPlayer->chainLength ? pMidiPlayer->pSequenceChain[pMidiPlayer->chainPos++] : 0;
+    startSequence(pMidiPlayer, first < midiReadGetNumTracks(pMidiPlayer->pMidiFile) ? first : 0, 0);
+    return true;
+  }
+
+  // Load initial midi events
+  for (int iTrack = 0; iTrack < midiReadGetNumTracks(pMidiPlayer->pMidiFile); iTrack++) {
+    pMidiPlayer->eventPending[iTrack] = midiReadGetNextEvent(pMidiPlayer->pMidiFile, iTrack, &pMidiPlayer->event[iTrack]);
+    pMidiPlayer->pMidiFile->Track[iTrack].deltaTime = pMidiPlayer->event[iTrack].tick;
+  }
+
+  return true;
+}
+
+// Format 2 only: plays the sequence iTrack from its beginning right away. Afterwards, playback continues with the
+// sequence chain or with the following track.
+bool midiPlayerPlaySequence(MIDI_PLAYER* pMidiPlayer, int32_t iTrack) {
+  if (!pMidiPlayer->pMidiFile || pMidiPlayer->sequence < 0 || iTrack < 0 ||
+      iTrack >= midiReadGetNumTracks(pMidiPlayer->pMidiFile))
+    return false;
+
+  startSequence(pMidiPlayer, iTrack, 0);
+  pMidiPlayer->allTracksAreFinished = false;
+  return true;
+}
+
+// Format 2 only: sets the order, in which the sequences (tracks) are played. A track may appear several times, so
+// patterns are stored once in the file. pChain must stay valid while it is used. It may be changed during playback,
+// then it takes effect, when the current sequence ends. Pass NULL to play the tracks in file order.
+void midiPlayerSetSequenceChain(MIDI_PLAYER* pMidiPlayer, const uint8_t* pChain, uint32_t length, bool bLoop) {
+  pMidiPlayer->pSequenceChain = pChain;
+  pMidiPlayer->chainLength = length;
+  pMidiPlayer->chainPos = 0;
+  pMidiPlayer->bLoopChain = bLoop;
+}
+
+// Times playback by the tempo map of the opened file (see midiFileBuildTempoMap()), which avoids the rounding of
+// adjustTimeFactor() and allows seeking with the right tempo. Must be set before playback starts, NULL switches
+// back to the tempo events. The map is reset, when a new file is opened. Format 2 sequences have a tempo of their
+// own each, so the map is not used for them.
+void midiPlayerSetTempoMap(MIDI_PLAYER* pMidiPlayer, const MIDI_TEMPO_MAP* pTempoMap) {
+  pMidiPlayer->pTempoMap = pMidiPlayer->sequence < 0 ? pTempoMap : NULL;
+}
+
+// Continues playback at 'tick'. With a seek index (see midiFileBuildSeekIndex()) only a few events per track are
+// decoded, otherwise the whole file up to 'tick'. Tempo changes before 'tick' are only applied with a tempo map.
+bool midiPlayerSeek(MIDI_PLAYER* pMidiPlayer, const MIDI_SEEK_INDEX* pIndex, uint32_t tick) {
+  if (!pMidiPlayer->pMidiFile || !midiFileSeek(pMidiPlayer->pMidiFile, pIndex, tick))
+    return false;
+
+  for (int iTrack = 0; iTrack < midiReadGetNumTracks(pMidiPlayer->pMidiFile); iTrack++) {
+    pMidiPlayer->eventPending[iTrack] = midiReadGetNextEvent(pMidiPlayer->pMidiFile, iTrack, &pMidiPlayer->event[iTrack]);
+    pMidiPlayer->pMidiFile->Track[iTrack].deltaTime = pMidiPlayer->event[iTrack].tick - tick;
+  }
+
+  if (pMidiPlayer->pTempoMap) {
+    setPlaybackTempo(pMidiPlayer->pMidiFile, MICROSECONDS_PER_MINUTE / midiTempoMapGetTempo(pMidiPlayer->pTempoMap, tick));
+    pMidiPlayer->lastUsPerTick = pMidiPlayer->pMidiFile->usPerTick;
+  }
+
+  pMidiPlayer->startTime = hal_clock() * 1000;
+  pMidiPlayer->startTick = tick;
+  pMidiPlayer->currentTick = 0;
+  pMidiPlayer->lastTick = 0;
   return true;
 }
 
@@ -269,12 +443,13 @@ bool isItTimeToFireThisEvent(MIDI_PLAYER* pMp, int iTrack) {
       hal_printfWarning("Expected: %d ms, real: %d ms, diff: %d ms", expectedWaitTime, realWaitTime, diff);
     // ---
 
-    midiReadGetNextMessage(pMp->pMidiFile, iTrack, &pMp->msg[iTrack]); // reload
-    pMp->pMidiFile->Track[iTrack].deltaTime += pMp->msg[iTrack].dt;
+    uint32_t lastTick = pMp->event[iTrack].tick;
+    pMp->eventPending[iTrack] = midiReadGetNextEvent(pMp->pMidiFile, iTrack, &pMp->event[iTrack]); // reload
+    pMp->pMidiFile->Track[iTrack].deltaTime += pMp->event[iTrack].tick - lastTick;
 
     // Debug 2/2
     pMp->pMidiFile->Track[iTrack].debugLastClock = hal_clock();
-    pMp->pMidiFile->Track[iTrack].debugLastMsgDt = pMp->msg[iTrack].dt;
+    pMp->pMidiFile->Track[iTrack].debugLastMsgDt = pMp->event[iTrack].tick - lastTick;
     // ---
 
     return true;
@@ -297,8 +472,11 @@ bool processTracks(MIDI_PLAYER* pMp) {
   pMp->allTracksAreFinished = true;
 
   for (int iTrack = 0; iTrack < midiReadGetNumTracks(pMp->pMidiFile); iTrack++) {
+    if (pMp->sequence >= 0 && iTrack != pMp->sequence)
+      continue; // format 2 plays one sequence at a time
+
     pMp->pMidiFile->Track[iTrack].deltaTime -= deltaTick;
-    pMp->trackIsFinished = pMp->pMidiFile->Track[iTrack].ptrNew == pMp->pMidiFile->Track[iTrack].pEndNew;
+    pMp->trackIsFinished = !pMp->eventPending[iTrack];
 
     if (!pMp->trackIsFinished) {
       pMp->allTracksAreFinished = false;
@@ -308,6 +486,11 @@ bool processTracks(MIDI_PLAYER* pMp) {
 
   pMp->lastTick = pMp->currentTick;
 
+  if (pMp->sequence >= 0 && pMp->allTracksAreFinished && nextSequence(pMp)) {
+    pMp->allTracksAreFinished = false;
+    eventsNeedToBeFetched = true;
+  }
+
   return eventsNeedToBeFetched;
 }
 
@@ -317,7 +500,13 @@ bool midiPlayerTick(MIDI_PLAYER* pMidiPlayer) {
   if (pMp->pMidiFile == NULL)
     return false;
 
-  pMp->currentTick = (hal_clock() * 1000 - pMp->startTime) / pMp->pMidiFile->usPerTick;
+  if (pMp->pTempoMap) {
+    uint64_t us = midiTempoMapTickToUs(pMp->pTempoMap, pMp->startTick) + (uint32_t)(hal_clock() * 1000 - pMp->startTime);
+    pMp->currentTick = midiTempoMapUsToTick(pMp->pTempoMap, us) - pMp->startTick;
+  }
+  else {
+    pMp->currentTick = (hal_clock() * 1000 - pMp->startTime) / pMp->pMidiFile->usPerTick;
+  }
   while (processTracks(pMidiPlayer)); // This loop keeps all tracks synchronized in case of a lag
 
   return !pMp->allTracksAreFinished; // TODO: close file
@@ -30,17 +30,33 @@ typedef void(*OnMetaSequencerSpecificCallback_t)(int32_t track, int32_t tick, vo
 typedef void(*OnMetaSysExCallback_t)(int32_t track, int32_t tick, void* pData, uint32_t size);
 
 // Custom callbacks
-// TODO: onCacheMiss()
+
+// Streams a SysEx or sequencer specific payload in pieces of up to META_EVENT_MAX_DATA_SIZE bytes. pos is the
+// position of the piece within the payload, the last piece ends at totalSize.
+typedef void(*OnPayloadChunkCallback_t)(int32_t track, int32_t tick, const void* pData, uint32_t size, uint32_t pos, uint32_t totalSize);
 
 typedef struct {
   _MIDI_FILE* pMidiFile;
-  MIDI_MSG msg[MAX_MIDI_TRACKS];
+  MIDI_EVENT event[MAX_MIDI_TRACKS]; // next event of each track (lookahead)
+  bool eventPending[MAX_MIDI_TRACKS]; // lookahead event is valid and not yet dispatched
+  MIDI_MSG msg; // expanded meta event which is currently dispatched (tempo, time and key signature, ...)
+  uint8_t payload[META_EVENT_MAX_DATA_SIZE + 1]; // text and SysEx data of the current event (+ 1 byte for nullterminator)
   int32_t startTime;
   int32_t currentTick;
   int32_t lastTick;
   bool trackIsFinished;
   bool allTracksAreFinished;
   int32_t lastUsPerTick;
+  uint16_t eventFilter; // event types to play, see MIDI_FILTER_*
+  const MIDI_TEMPO_MAP* pTempoMap; // optional, if set, ticks are derived from the tempo map instead of adjustTimeFactor()
+  uint32_t startTick; // absolute position of currentTick 0
+
+  // Format 2: every track is a sequence of its own, which is played alone and starts with the default tempo
+  int32_t sequence; // track being played, -1 in format 0 and 1 (all tracks together)
+  const uint8_t* pSequenceChain; // tracks to play one after the other, NULL for file order
+  uint32_t chainLength;
+  uint32_t chainPos; // index of the next sequence in pSequenceChain
+  bool bLoopChain;
 
   // Callback function pointers
   OnNoteOffCallback_t pOnNoteOffCb;
@@ -67,6 +83,10 @@ typedef struct {
   OnMetaSequencerSpecificCallback_t pOnMetaSequencerSpecificCb;
   OnMetaSysExCallback_t pOnMetaSysExCb;
 
+  // Optional, if set they replace pOnMetaSysExCb and pOnMetaSequencerSpecificCb
+  OnPayloadChunkCallback_t pOnSysExChunkCb;
+  OnPayloadChunkCallback_t pOnSequencerSpecificChunkCb;
+
 } MIDI_PLAYER;
 
 void midiplayer_init(MIDI_PLAYER* mpl, 
@@ -95,6 +115,15 @@ void midiplayer_init(MIDI_PLAYER* mpl,
   OnMetaSysExCallback_t pOnMetaSysExCb
 );
 
+void midiPlayerSetChunkCallbacks(MIDI_PLAYER* mpl, OnPayloadChunkCallback_t pOnSysExChunkCb,
+  OnPayloadChunkCallback_t pOnSequencerSpecificChunkCb);
+
+void midiPlayerSetEventFilter(MIDI_PLAYER* mpl, uint16_t filter);
+
+void midiPlayerSetTempoMap(MIDI_PLAYER* pMidiPlayer, const MIDI_TEMPO_MAP* pTempoMap);
+bool midiPlayerSeek(MIDI_PLAYER* pMidiPlayer, const MIDI_SEEK_INDEX* pIndex, uint32_t tick);
+bool midiPlayerPlaySequence(MIDI_PLAYER* pMidiPlayer, int32_t iTrack);
+void midiPlayerSetSequenceChain(MIDI_PLAYER* pMidiPlayer, const uint8_t* pChain, uint32_t length, bool bLoop);
 bool midiPlayerTick(MIDI_PLAYER* pMidiPlayer);
 bool playMidiFile(MIDI_PLAYER* pMidiPlayer, const char *pFilename);
 void adjustTimeFactor(MIDI_PLAYER* pMp);
@@ -51,8 +51,8 @@ iTimeMS = milli-seconds
 typedef struct {
 		int 		iTempo;
 		/* Conversion specifics */
-		BOOL		bDoneHeader;		/* text */
-		BOOL		bNeedPrefixComma;	/* text */
+		bool		bDoneHeader;		/* text */
+		bool		bNeedPrefixComma;	/* text */
 		int		iSndFile;		/* spkr */
 		float		fMult;			/* spkr */
 		} CONVERT_PREFS;
@@ -62,8 +62,8 @@ typedef void (*cb_Output)(int iNote, int iVol, int iTimeMS, CONVERT_PREFS *pPref
 void InitPrefs(CONVERT_PREFS *pPrefs)
 {
 	pPrefs->iTempo = 100;
-	pPrefs->bDoneHeader = FALSE;
-	pPrefs->bNeedPrefixComma = FALSE;
+	pPrefs->bDoneHeader = false;
+	pPrefs->bNeedPrefixComma = false;
 	pPrefs->iSndFile = 1;
 }
 
@@ -120,7 +120,7 @@ int iLen;
 		{
 		int tempo = rtttlGetClosestTempo(pPrefs->iTempo/4);
 		printf("t=%d:", tempo);
-		pPrefs->bDoneHeader = TRUE;
+		pPrefs->bDoneHeader = true;
 		}
 
 	if (pPrefs->bNeedPrefixComma)
@@ -129,7 +129,7 @@ int iLen;
 	iLen = (32*384)/iDeltaTime;
 	printf("%d%s%d", iLen, pNoteNames[iNote%12], (iNote/12)-3);
 
-	pPrefs->bNeedPrefixComma = TRUE;
+	pPrefs->bNeedPrefixComma = true;
 }
 
 void outSMLCCode(int iNote, int iVol, int iDeltaTime, CONVERT_PREFS *pPrefs)
@@ -157,71 +157,71 @@ int dtPos;
 
 	if (mf)
 		{
+		MIDI_MERGE merge;
+		MIDI_EVENT event;
 		MIDI_MSG msg;
-		int i, iNum;
 
 		dtPos = 0;
 		iCurrPlayingNote = -1;
 		iCurrPlayStart = 0;
 		iCurrPlayingVol = 127; /* paranoia: shouldn't be able to play a note with a note-down msg */
 		midiReadInitMessage(&msg);
-		iNum = midiReadGetNumTracks(mf);
 
-		for(i=0;i<iNum;i++)
+		/* All tracks in time order, so tempo changes and notes on other tracks come where they belong */
+		midiReadInitMerge(mf, &merge);
+		while(midiReadGetNextMergedEvent(mf, &merge, &event))
 			{
-			while(midiReadGetNextMessage(mf, i, &msg))
-				{
-				dtPos = (msg.dwAbsPos - iCurrPlayStart);
+			if (!midiReadEventToMessage(mf, &event, &msg))
+				continue;
+			dtPos = (msg.dwAbsPos - iCurrPlayStart);
 
-				switch(msg.iType)
-					{
-					case	msgNoteOff:
-							if (iChannel == msg.MsgData.NoteOff.iChannel)
+			switch(msg.iType)
+				{
+				case	msgNoteOff:
+						if (iChannel == msg.MsgData.NoteOff.iChannel)
+						{
+						if (iCurrPlayingNote==msg.MsgData.NoteOff.iNote)	
 							{
-							if (iCurrPlayingNote==msg.MsgData.NoteOff.iNote)	
-								{
-								(*pAddNote)(iCurrPlayingNote, iCurrPlayingVol, dtPos, pPrefs);
-								iCurrPlayingNote = -1;
-								iCurrPlayStart = msg.dwAbsPos;
-								}
+							(*pAddNote)(iCurrPlayingNote, iCurrPlayingVol, dtPos, pPrefs);
+							iCurrPlayingNote = -1;
+							iCurrPlayStart = msg.dwAbsPos;
 							}
-							break;
+						}
+						break;
 
-					case	msgNoteOn:
-							if (iChannel == msg.MsgData.NoteOn.iChannel)
+				case	msgNoteOn:
+						if (iChannel == msg.MsgData.NoteOn.iChannel)
+						{
+						if (iCurrPlayingNote==-1)
+							{ /* play a rest*/
+							(*pAddNote)(0, 0, dtPos, pPrefs);
+							}
+						else
 							{
-							if (iCurrPlayingNote==-1)
-								{ /* play a rest*/
-								(*pAddNote)(0, 0, dtPos, pPrefs);
-								}
-							else
-								{
-								(*pAddNote)(iCurrPlayingNote, iCurrPlayingVol, dtPos, pPrefs);
-								}
-							iCurrPlayingNote = msg.MsgData.NoteOn.iNote;
-							iCurrPlayingVol = msg.MsgData.NoteOn.iVolume;
-							iCurrPlayStart = msg.dwAbsPos;
+							(*pAddNote)(iCurrPlayingNote, iCurrPlayingVol, dtPos, pPrefs);
 							}
-							break;
-					case	msgMetaEvent:
-							switch(msg.MsgData.MetaEvent.iType)
-								{
-								case	metaSetTempo:
-									pPrefs->iTempo = msg.MsgData.MetaEvent.Data.Tempo.iBPM;
-									break;
-								default:
-									/* Ignore other cases */
-									break;
-								}
-							break;
-					default:
-						/* Ignore other cases */
+						iCurrPlayingNote = msg.MsgData.NoteOn.iNote;
+						iCurrPlayingVol = msg.MsgData.NoteOn.iVolume;
+						iCurrPlayStart = msg.dwAbsPos;
+						}
 						break;
-					}
+				case	msgMetaEvent:
+						switch(msg.MsgData.MetaEvent.iType)
+							{
+							case	metaSetTempo:
+								pPrefs->iTempo = msg.MsgData.MetaEvent.Data.Tempo.iBPM;
+								break;
+							default:
+								/* Ignore other cases */
+								break;
+							}
+						break;
+				default:
+					/* Ignore other cases */
+					break;
 				}
 			}
 
-		midiReadFreeMessage(&msg);
 		midiFileClose(mf);
 		}
 }
@@ -245,8 +245,8 @@ int main(int argc, char* argv[])
 {
 int c;
 int iChan = 1;
-BOOL bError = FALSE;
-BOOL bRTTTL = FALSE, bSpeaker = FALSE;
+bool bError = false;
+bool bRTTTL = false, bSpeaker = false;
 CONVERT_PREFS prefs;
 
 	while((c=getopt(argc, argv, "Cc:HRShrs"))!=-1)
@@ -260,12 +260,12 @@ CONVERT_PREFS prefs;
 
 			case	'R':
 			case	'r':	/* output RTTTL */
-					bRTTTL = TRUE;
+					bRTTTL = true;
 					break;
 
 			case	'S':
 			case	's':	/* output speaker */	
-					bSpeaker = TRUE;
+					bSpeaker = true;
 					break;
 			
 			case	'H':
@@ -275,7 +275,7 @@ CONVERT_PREFS prefs;
 					break;
 
 			case	'?':	/* error */
-					bError = TRUE;
+					bError = true;
 					break;
 			case	':':
 					fprintf(stderr, "%s: The %c option needs an operand\n", argv[0], optopt);
@@ -285,8 +285,8 @@ CONVERT_PREFS prefs;
 			}
 		}	
 	/* Default to RTTTL if nothing specified */
-	if (bRTTTL == bSpeaker && bSpeaker == FALSE)
-		bRTTTL = TRUE;
+	if (bRTTTL == bSpeaker && bSpeaker == false)
+		bRTTTL = true;
 
 	if (bError)	
 		{
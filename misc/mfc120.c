@@ -23,27 +23,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#ifndef  __APPLE__
-#include <malloc.h>
-#endif
 #include "midifile.h"
 
-BOOL midi_convert120(const char *dest, const char *src, BOOL bOverwrite)
+bool midi_convert120(const char *dest, const char *src, bool bOverwrite)
 {
 MIDI_FILE *pInFile;
 MIDI_FILE *pOutFile;
-MIDI_MSG msg[MAX_MIDI_TRACKS];
-BYTE bValidChannels[MAX_MIDI_TRACKS];
-BYTE bReadableChannels[MAX_MIDI_TRACKS];
-int l, tracks_left_to_process;
-DWORD src_song_pos;
-BOOL bWasLastBestMsgPriority;		/* ie sysex or meta-event */
-int curr_best_track=0; /* paranoia - shouldn't get used unless flush; which needs one track at least */
-DWORD curr_lowest_dt, dt;
-int pqn = 384;
-
-	for(l=0;l<MAX_MIDI_TRACKS;l++)
-		midiReadInitMessage(&msg[l]);
+MIDI_MERGE merge;
+MIDI_EVENT event;
+uint32_t out_song_pos, out_pos, out_end_pos;
+int pqn = 384, failed = 0;
+bool bConverted = false;
 
 	if ((pInFile = midiFileOpen(src)))
 		{
@@ -55,82 +45,46 @@ int pqn = 384;
 			{
 			if ((pOutFile = midiFileCreate(dest, bOverwrite)))
 				{
+				midiFileSetVersion(pOutFile, 0);
 				/* Alogrithm:
-				**		Scan all tracks to find the msg with the lowest 'dt' (use META/SYSEX events first in case of tie-break)
-				**		Write msg out. Update song pos
-				**		Prepare to refill the last best track with more data
+				**		Read the events of all tracks in time order (META/SYSEX events first in case of tie-break)
+				**		Write each one out
 				**
-				** lowest 'dt' should NOT be used: compare song_pos, and msg's own track pos
-				** 'bReadableChannels' are those where data should be taken from to form the next line of possible 'next lowest dt' candidates
+				** Positions are scaled from the song pos, not from the delta times, so rounding doesn't add up
+				** The End of Track events are replaced by one at the end of the longest track, so trailing silence stays
 				*/
-				memset(bValidChannels,'\1', sizeof(bValidChannels));
-				memset(bReadableChannels,'\1', sizeof(bReadableChannels));
-				tracks_left_to_process = MAX_MIDI_TRACKS;
-				src_song_pos = 0;
+				midiReadInitMerge(pInFile, &merge);
+				out_song_pos = out_end_pos = 0;
 				/**/ 
-				do
+				while(midiReadGetNextMergedEvent(pInFile, &merge, &event))
 					{
-					curr_lowest_dt = 0xffffffff;
-					bWasLastBestMsgPriority = FALSE;
-					/**/
-					for(l=0;l<MAX_MIDI_TRACKS;l++)		
-						if (bValidChannels[l])
-							{
-							if (bReadableChannels[l])	/* should we read another msg from the queue? */
-								{
-								if (midiReadGetNextMessage(pInFile, l, &msg[l]))
-									{
-									bReadableChannels[l] = FALSE;
-									}
-								else	/* can not read data on this track!*/
-									{
-									bValidChannels[l] = FALSE;
-									tracks_left_to_process--;
-									}
-								}
-							/**/
-							dt = msg[l].dwAbsPos - src_song_pos;
-							if (bValidChannels[l] && dt <= curr_lowest_dt)	/* <= too permit priority testing */
-								{
-								/* We add if = , and this is a priority, or the time is better:*/
-								if ((dt == curr_lowest_dt && (msg[l].iType & msgSysMask)) || dt<curr_lowest_dt)
-									{
-									curr_lowest_dt = msg[l].dwAbsPos - src_song_pos;
-									curr_best_track = l;
-									/**/
-									if (msg[l].iType & msgSysMask)
-										bWasLastBestMsgPriority = TRUE;
-									}
-								}
-							}
-					/**/ 
-					if (curr_lowest_dt == 0xffffffff)		/* we must have exhuasted all tracks of msgs!*/
+					out_pos = (uint32_t)((uint64_t)event.tick*pqn/midiFileGetPPQN(pInFile));
+					if (event.status == msgMetaEvent && event.data1 == metaEndSequence)
 						{
-						tracks_left_to_process = 0;			/* Double check - this should be 0 anyway*/
-						}
-					else 
-						{
-						if (curr_lowest_dt)
-							dt = 0;
-
-						dt = (curr_lowest_dt*pqn)/midiFileGetPPQN(pInFile);
-						src_song_pos += curr_lowest_dt;
-						/**/
-						if (msg[curr_best_track].iType == msgMetaEvent && msg[curr_best_track].MsgData.MetaEvent.iType == metaEndSequence)
-							;
-						else	/* write best msg out, and flag it to get new data */
-							midiTrackAddRaw(pOutFile, 0, msg[curr_best_track].iMsgSize, msg[curr_best_track].data, TRUE, dt);
-						/**/
-						bReadableChannels[curr_best_track] = TRUE;
+						if (out_pos > out_end_pos)
+							out_end_pos = out_pos;
+						continue;
 						}
 					/**/
+					/* the position moves on, even if the event can't be copied */
+					if (!midiTrackIncTime(pOutFile, 0, out_pos - out_song_pos, true) ||
+						!midiTrackCopyEvent(pOutFile, 0, pInFile, &event))
+						failed++;
+					out_song_pos = out_pos;
 					}
-				while(tracks_left_to_process);
 				/**/
+				if (out_end_pos > out_song_pos)
+					midiTrackIncTime(pOutFile, 0, out_end_pos - out_song_pos, true);
 				midiSongAddEndSequence(pOutFile, 0);
-				midiFileClose(pOutFile);
-				/**/
-				fprintf(stderr, "Success! %s converted sucessfully.\n", src);
+				if (!midiFileClose(pOutFile))
+					fprintf(stderr, "Error: %s could not be written.\n", dest);
+				else if (failed)
+					fprintf(stderr, "Error: %d events of %s could not be copied.\n", failed, src);
+				else
+					{
+					fprintf(stderr, "Success! %s converted sucessfully.\n", src);
+					bConverted = true;
+					}
 				}
 			else	/* can not open the dest file */
 				{
@@ -138,16 +92,13 @@ int pqn = 384;
 				}
 			}
 		
-		free(pInFile);
+		midiFileClose(pInFile);
 		}
 	else
 		{
 		fprintf(stderr, "Error: %s does not exist.\n", src);
 		}
 	/**/
-	for(l=0;l<MAX_MIDI_TRACKS;l++)
-		midiReadFreeMessage(&msg[l]);
-	/**/
-	return TRUE;
+	return bConverted;
 
 }
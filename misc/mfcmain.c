@@ -29,14 +29,15 @@
 #include "midifile.h"
 #include "mozart.h"
 
-extern BOOL midi_convert120(const char *dest, const char *src, BOOL bOverwrite);
+extern bool midi_convert120(const char *dest, const char *src, bool bOverwrite);
 
 int main(int argc, char* argv[])
 {
 	if (argc < 3)
+		{
 		fprintf(stderr, "Usage: %s <src name> <dest name>\n", argv[0]);
-	else
-		midi_convert120(argv[2], argv[1], FALSE);
+		return 1;
+		}
 
-	return 0;
+	return midi_convert120(argv[2], argv[1], false) ? 0 : 1;
 }
@@ -0,0 +1,432 @@
+/*
+ * midibench.c - Measures the decoding speed of the MIDI file reader for
+ *				each cache mode, using a set of MIDI files (i.e. the MIDIFiles folder).
+ *				Requires Steevs MIDI Library and the Linux HAL.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of
+ *  the License,or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include "hal/hal_filesystem.h"
+#include "midifile.h"
+
+#define BENCH_BATCH_SIZE 256
+#define BENCH_SEEK_POINTS 4096
+#define BENCH_SEEKS 100
+#define BENCH_MAX_CACHE_SIZE (64 * 1024)
+#define BENCH_JITTER_EVENTS 20000   // events per file
+#define BENCH_JITTER_SPACING 20000 // nanoseconds between two events, like a busy file during playback
+
+typedef struct {
+  uint64_t bytes;
+  uint64_t events;
+  double seconds;
+  uint64_t refills;         // cache counters, summed over all files
+  uint64_t bytesFetched;
+  uint32_t maxRefillTimeUs;
+} BENCH_RESULT;
+
+static _MIDI_FILE g_midiFile;
+static MIDI_EVENT g_event[MAX_MIDI_TRACKS];
+static MIDI_EVENT g_batch[BENCH_BATCH_SIZE];
+static MIDI_SEEK_POINT g_seekPoints[BENCH_SEEK_POINTS];
+static uint8_t g_cache[BENCH_MAX_CACHE_SIZE];
+
+static double benchNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void benchPrint(const char* pName, const BENCH_RESULT* pResult) {
+  printf("%-12s %10.2f MB/s %12.0f events/s  (%llu events, %.3f s)", pName,
+    pResult->bytes / pResult->seconds / (1024.0 * 1024.0), pResult->events / pResult->seconds,
+    (unsigned long long)pResult->events, pResult->seconds);
+  if (pResult->refills)
+    printf("  %llu refills, %.1f MB fetched, longest %u us", (unsigned long long)pResult->refills,
+      pResult->bytesFetched / (1024.0 * 1024.0), pResult->maxRefillTimeUs);
+  printf("\n");
+}
+
+static void benchAddCacheStats(MIDI_FILE* pMF, BENCH_RESULT* pResult) {
+  MIDI_CACHE_STATS stats;
+
+  midiFileGetCacheStats(pMF, -1, &stats);
+  pResult->refills += stats.refills;
+  pResult->bytesFetched += stats.bytesFetched;
+  if (stats.maxRefillTimeUs > pResult->maxRefillTimeUs)
+    pResult->maxRefillTimeUs = stats.maxRefillTimeUs;
+}
+
+// Decodes all events of a file in playback order, i.e. always the track with the earliest pending event next.
+// A cacheSize of 0 selects the built-in cache.
+static bool benchDecodeFile(const char* pFilename, tMIDI_CACHE_MODE mode, uint32_t cacheSize, BENCH_RESULT* pResult) {
+  MIDI_FILE* pMF = midiFileOpenCached(&g_midiFile, pFilename, cacheSize ? g_cache : NULL, cacheSize);
+  bool bValid[MAX_MIDI_TRACKS];
+  int32_t numTracks;
+
+  if (!pMF)
+    return false;
+
+  midiFileSetCacheMode(pMF, mode);
+  numTracks = midiReadGetNumTracks(pMF);
+  for (int32_t iTrack = 0; iTrack < numTracks; ++iTrack) {
+    bValid[iTrack] = midiReadGetNextEvent(pMF, iTrack, &g_event[iTrack]);
+  }
+
+  for (;;) {
+    int32_t iBest = -1;
+    for (int32_t iTrack = 0; iTrack < numTracks; ++iTrack)
+      if (bValid[iTrack] && (iBest < 0 || g_event[iTrack].tick < g_event[iBest].tick))
+        iBest = iTrack;
+
+    if (iBest < 0)
+      break;
+
+    pResult->events++;
+    bValid[iBest] = midiReadGetNextEvent(pMF, iBest, &g_event[iBest]);
+  }
+
+  for (int32_t iTrack = 0; iTrack < numTracks; ++iTrack)
+    pResult->bytes += g_midiFile.Track[iTrack].sz;
+
+  benchAddCacheStats(pMF, pResult);
+  midiFileClose(pMF);
+  return true;
+}
+
+// Decodes all events of an open file track by track with the batch decoder, as an offline analysis tool would do.
+static void benchDecodeTracks(MIDI_FILE* pMF, BENCH_RESULT* pResult) {
+  int32_t numTracks = midiReadGetNumTracks(pMF);
+  int32_t numEvents;
+
+  for (int32_t iTrack = 0; iTrack < numTracks; ++iTrack) {
+    while ((numEvents = midiReadGetNextEvents(pMF, iTrack, g_batch, BENCH_BATCH_SIZE)) > 0)
+      pResult->events += numEvents;
+    pResult->bytes += g_midiFile.Track[iTrack].sz;
+  }
+}
+
+static bool benchDecodeFileBatch(const char* pFilename, tMIDI_CACHE_MODE mode, BENCH_RESULT* pResult) {
+  MIDI_FILE* pMF = midiFileOpenInstance(&g_midiFile, pFilename);
+
+  if (!pMF)
+    return false;
+
+  midiFileSetCacheMode(pMF, mode);
+  benchDecodeTracks(pMF, pResult);
+  benchAddCacheStats(pMF, pResult);
+  midiFileClose(pMF);
+  return true;
+}
+
+// I/O backend reading from a buffer in memory. It can't map, so the reader goes through its cache, as it would
+// for a stream fed by the network.
+typedef struct {
+  const uint8_t* pData;
+  uint32_t size;
+} BENCH_BUFFER;
+
+static uint32_t benchBufferRead(void* pContext, uint32_t pos, void* dst, uint32_t numBytes) {
+  BENCH_BUFFER* pBuffer = pContext;
+  if (pos >= pBuffer->size)
+    return 0;
+  if (numBytes > pBuffer->size - pos)
+    numBytes = pBuffer->size - pos;
+  memcpy(dst, &pBuffer->pData[pos], numBytes);
+  return numBytes;
+}
+
+static uint32_t benchBufferSize(void* pContext) {
+  return ((BENCH_BUFFER*)pContext)->size;
+}
+
+static const MIDI_IO g_bufferIo = {
+  .read = benchBufferRead,
+  .size = benchBufferSize,
+};
+
+// Measures the decoder alone: all files are loaded into memory before the clock starts. With bIo, the files are
+// read through the cache in per track mode, otherwise in place.
+static void benchRunMemory(const char* pName, uint16_t filter, bool bIo, char** ppFiles, int numFiles, int repeat) {
+  BENCH_RESULT result = { 0 };
+  uint8_t** ppData = calloc(numFiles, sizeof(uint8_t*));
+  uint32_t* pSize = calloc(numFiles, sizeof(uint32_t));
+  double start;
+
+  for (int iFile = 0; iFile < numFiles; ++iFile) {
+    FILE* pFile = fopen(ppFiles[iFile], "rb");
+    if (!pFile)
+      continue;
+    fseek(pFile, 0, SEEK_END);
+    pSize[iFile] = ftell(pFile);
+    fseek(pFile, 0, SEEK_SET);
+    ppData[iFile] = malloc(pSize[iFile]);
+    if (ppData[iFile] && fread(ppData[iFile], 1, pSize[iFile], pFile) != pSize[iFile])
+      pSize[iFile] = 0;
+    fclose(pFile);
+  }
+
+  start = benchNow();
+  for (int i = 0; i < repeat; ++i)
+    for (int iFile = 0; iFile < numFiles; ++iFile) {
+      BENCH_BUFFER buffer = { ppData[iFile], pSize[iFile] };
+      MIDI_FILE* pMF = NULL;
+
+      if (ppData[iFile] && bIo)
+        pMF = midiFileOpenIo(&g_midiFile, &g_bufferIo, &buffer);
+      else if (ppData[iFile])
+        pMF = midiFileOpenFromMemory(&g_midiFile, ppData[iFile], pSize[iFile]);
+      if (pMF) {
+        midiFileSetCacheMode(pMF, cachePerTrack);
+        midiFileSetEventFilter(pMF, -1, filter);
+        benchDecodeTracks(pMF, &result);
+        midiFileClose(pMF);
+      }
+    }
+  result.seconds = benchNow() - start;
+
+  benchPrint(pName, &result);
+
+  for (int iFile = 0; iFile < numFiles; ++iFile)
+    free(ppData[iFile]);
+  free(ppData);
+  free(pSize);
+}
+
+static void benchRun(const char* pName, tMIDI_CACHE_MODE mode, bool bBatch, char** ppFiles, int numFiles, int repeat) {
+  BENCH_RESULT result = { 0 };
+  double start = benchNow();
+
+  for (int i = 0; i < repeat; ++i)
+    for (int iFile = 0; iFile < numFiles; ++iFile) {
+      if (bBatch)
+        benchDecodeFileBatch(ppFiles[iFile], mode, &result);
+      else
+        benchDecodeFile(ppFiles[iFile], mode, 0, &result);
+    }
+
+  result.seconds = benchNow() - start;
+  benchPrint(pName, &result);
+}
+
+// Shows the refills and the data read per cache size, to pick the cache size of a product
+static void benchRunCacheSizes(tMIDI_CACHE_MODE mode, char** ppFiles, int numFiles) {
+  static const uint32_t sizes[] = { 1024, 2048, 4096, 10 * 1024, 32 * 1024, BENCH_MAX_CACHE_SIZE };
+
+  for (uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    BENCH_RESULT result = { 0 };
+    char name[32];
+    double start = benchNow();
+
+    for (int iFile = 0; iFile < numFiles; ++iFile)
+      benchDecodeFile(ppFiles[iFile], mode, sizes[i], &result);
+    result.seconds = benchNow() - start;
+
+    snprintf(name, sizeof(name), "%s %uK", mode == cacheSectorAligned ? "sector" : "track", sizes[i] / 1024);
+    benchPrint(name, &result);
+  }
+}
+
+// Opens a file with the HAL backend, but without mapping it, so reads can be counted
+static MIDI_FILE* benchOpenUnmapped(const char* pFilename) {
+  static MIDI_IO io;
+  FILE* pFile = NULL;
+
+  io = midiIoHal;
+  io.map = NULL;
+  if (!hal_fopen(&pFile, pFilename) || !pFile)
+    return NULL;
+  return midiFileOpenIo(&g_midiFile, &io, pFile);
+}
+
+// Compares the time and the data read to get a catalog entry of each file: opening it (header and track table),
+// probing it and probing it with its duration.
+static void benchRunProbe(char** ppFiles, int numFiles, int repeat) {
+  static const char* pNames[] = { "open", "probe", "probe+length" };
+
+  for (int iRun = 0; iRun < 3; ++iRun) {
+    uint64_t bytesRead = 0;
+    int numProbed = 0;
+    double start = benchNow(), seconds;
+
+    for (int i = 0; i < repeat; ++i)
+      for (int iFile = 0; iFile < numFiles; ++iFile) {
+        MIDI_FILE_INFO info;
+        MIDI_CACHE_STATS stats;
+        MIDI_FILE* pMF;
+
+        if (iRun > 0) {
+          if (midiFileProbe(ppFiles[iFile], &info, iRun == 2)) {
+            bytesRead += info.bytesRead;
+            numProbed++;
+          }
+        }
+        else if ((pMF = benchOpenUnmapped(ppFiles[iFile]))) {
+          midiFileGetCacheStats(pMF, -1, &stats);
+          bytesRead += stats.bytesFetched;
+          numProbed++;
+          midiFileClose(pMF);
+        }
+      }
+    seconds = benchNow() - start;
+
+    printf("%-12s %10.2f us/file %10.0f bytes/file  (%d files)\n", pNames[iRun],
+      numProbed ? seconds * 1e6 / numProbed : 0.0, numProbed ? (double)bytesRead / numProbed : 0.0, numProbed);
+  }
+}
+
+// Measures the time of seeks to random positions, linear and with a seek index of one checkpoint per 4 beats.
+static void benchRunSeek(char** ppFiles, int numFiles) {
+  double linear = 0.0, indexed = 0.0, build = 0.0;
+  int numSeeks = 0;
+
+  srand(1);
+  for (int iFile = 0; iFile < numFiles; ++iFile) {
+    MIDI_FILE* pMF = midiFileOpenInstance(&g_midiFile, ppFiles[iFile]);
+    MIDI_SEEK_INDEX index;
+    double start;
+
+    if (!pMF)
+      continue;
+
+    start = benchNow();
+    midiFileBuildSeekIndex(pMF, &index, g_seekPoints, BENCH_SEEK_POINTS, g_midiFile.Header.PPQN * 4);
+    build += benchNow() - start;
+
+    for (int i = 0; i < BENCH_SEEKS; ++i) {
+      uint32_t tick = index.lastTick ? rand() % index.lastTick : 0;
+
+      start = benchNow();
+      midiFileSeek(pMF, NULL, tick);
+      linear += benchNow() - start;
+
+      start = benchNow();
+      midiFileSeek(pMF, &index, tick);
+      indexed += benchNow() - start;
+      numSeeks++;
+    }
+
+    midiFileClose(pMF);
+  }
+
+  if (numSeeks)
+    printf("seek         %10.3f ms linear %10.3f ms indexed  (%d seeks, index build %.3f ms/file)\n",
+      linear * 1000.0 / numSeeks, indexed * 1000.0 / numSeeks, numSeeks, build * 1000.0 / numFiles);
+}
+
+static int benchCompareDouble(const void* a, const void* b) {
+  double d = *(const double*)a - *(const double*)b;
+  return d < 0 ? -1 : d > 0;
+}
+
+// Measures the time the player thread spends in the reader per event, while events are read at playback pace.
+// The files are dropped from the page cache before, so refills hit the disk.
+static void benchRunJitter(const char* pName, tMIDI_CACHE_MODE mode, char** ppFiles, int numFiles) {
+  static double latency[BENCH_JITTER_EVENTS];
+  const struct timespec spacing = { 0, BENCH_JITTER_SPACING };
+  double worst[3] = { 0.0, 0.0, 0.0 }; // 99th and 99.9th percentile, maximum
+  int numEvents = 0;
+
+  for (int iFile = 0; iFile < numFiles; ++iFile) {
+    FILE* pFile = fopen(ppFiles[iFile], "rb");
+    MIDI_FILE* pMF;
+    bool bValid[MAX_MIDI_TRACKS];
+    int32_t numTracks;
+    int n = 0;
+
+    if (!pFile)
+      continue;
+    posix_fadvise(fileno(pFile), 0, 0, POSIX_FADV_DONTNEED);
+    fclose(pFile);
+
+    if (!(pMF = midiFileOpenInstance(&g_midiFile, ppFiles[iFile])))
+      continue;
+    midiFileSetCacheMode(pMF, mode);
+    numTracks = midiReadGetNumTracks(pMF);
+    for (int32_t iTrack = 0; iTrack < numTracks; ++iTrack)
+      bValid[iTrack] = midiReadGetNextEvent(pMF, iTrack, &g_event[iTrack]);
+
+    while (n < BENCH_JITTER_EVENTS) {
+      double start;
+      int32_t iBest = -1;
+
+      for (int32_t iTrack = 0; iTrack < numTracks; ++iTrack)
+        if (bValid[iTrack] && (iBest < 0 || g_event[iTrack].tick < g_event[iBest].tick))
+          iBest = iTrack;
+      if (iBest < 0)
+        break;
+
+      start = benchNow();
+      bValid[iBest] = midiReadGetNextEvent(pMF, iBest, &g_event[iBest]);
+      latency[n++] = benchNow() - start;
+
+      nanosleep(&spacing, NULL); // wait for the next event, other threads may run meanwhile
+    }
+    midiFileClose(pMF);
+
+    if (n < 1000)
+      continue; // too short for percentiles
+    qsort(latency, n, sizeof(double), benchCompareDouble);
+    for (int i = 0; i < 3; ++i) {
+      double value = latency[i == 0 ? n * 99 / 100 : i == 1 ? n * 999 / 1000 : n - 1];
+      if (value > worst[i])
+        worst[i] = value;
+    }
+    numEvents += n;
+  }
+
+  printf("%-12s %10.1f us p99 %10.1f us p99.9 %10.1f us max  (%d events, worst file)\n", pName,
+    worst[0] * 1e6, worst[1] * 1e6, worst[2] * 1e6, numEvents);
+}
+
+int main(int argc, char* argv[]) {
+  int repeat = 10;
+  int firstFile = 1;
+
+  if (argc > 2 && strcmp(argv[1], "-r") == 0) {
+    repeat = atoi(argv[2]);
+    firstFile = 3;
+  }
+
+  if (firstFile >= argc) {
+    fprintf(stderr, "Usage: %s [-r repeat] <midi files...>\n", argv[0]);
+    return 1;
+  }
+
+  benchRun("stdio", cacheSingleWindow, false, &argv[firstFile], argc - firstFile, repeat);
+  benchRun("stdio/track", cachePerTrack, false, &argv[firstFile], argc - firstFile, repeat);
+  benchRun("stdio/sector", cacheSectorAligned, false, &argv[firstFile], argc - firstFile, repeat);
+  benchRun("mmap", cacheMapped, false, &argv[firstFile], argc - firstFile, repeat);
+  benchRun("stdio batch", cacheSingleWindow, true, &argv[firstFile], argc - firstFile, repeat);
+  benchRun("mmap batch", cacheMapped, true, &argv[firstFile], argc - firstFile, repeat);
+  benchRunMemory("memory batch", MIDI_FILTER_ALL, false, &argv[firstFile], argc - firstFile, repeat);
+  benchRunMemory("memory notes", MIDI_FILTER_NOTE_ON | MIDI_FILTER_NOTE_OFF | MIDI_FILTER_PROGRAM, false,
+    &argv[firstFile], argc - firstFile, repeat);
+  benchRunMemory("memory io", MIDI_FILTER_ALL, true, &argv[firstFile], argc - firstFile, repeat);
+  benchRunCacheSizes(cachePerTrack, &argv[firstFile], argc - firstFile);
+  benchRunCacheSizes(cacheSectorAligned, &argv[firstFile], argc - firstFile);
+  benchRunProbe(&argv[firstFile], argc - firstFile, repeat);
+  benchRunSeek(&argv[firstFile], argc - firstFile);
+  benchRunJitter("jitter", cachePerTrack, &argv[firstFile], argc - firstFile);
+  benchRunJitter("jitter/pf", cachePrefetch, &argv[firstFile], argc - firstFile);
+  return 0;
+}
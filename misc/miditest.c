@@ -34,7 +34,7 @@ void TestScale(void)
 {
 MIDI_FILE *mf;
 
-	if ((mf = midiFileCreate("test.mid", TRUE)))
+	if ((mf = midiFileCreate("test.mid", true)))
 		{
 		char *sing[] = {"Doh", "Ray", "Me", "Fah", "So", "La", "Ti", "Doh!"};
 		int i, scale[] = {MIDI_OCTAVE_3, MIDI_OCTAVE_3+MIDI_NOTE_D, 
@@ -61,7 +61,7 @@ MIDI_FILE *mf;
 		for(i=0;i<8;i++)
 			{
 			midiTrackAddText(mf, 1, textLyric, sing[i]);
-			midiTrackAddNote(mf, 1, scale[i], MIDI_NOTE_CROCHET, MIDI_VOL_HALF, TRUE, FALSE);
+			midiTrackAddNote(mf, 1, scale[i], MIDI_NOTE_CROCHET, MIDI_VOL_HALF, true, false);
 			}
 		midiFileClose(mf);
 		}
@@ -93,7 +93,7 @@ int melody[][2] = {
 };
 int i;
 	
-	if ((mf = midiFileCreate("test2.mid", TRUE)))
+	if ((mf = midiFileCreate("test2.mid", true)))
 		{
 		/* Set-up an environment for the sound */
 		midiSongAddKeySig(mf, 1, keyAMaj);		
@@ -119,7 +119,7 @@ int i;
 		/* Write melody to track 1 */
 		for(i=0;i<sizeof(melody)/sizeof(melody[0]);i++)
 			{
-			midiTrackAddNote(mf, 1, MIDI_OCTAVE_4+melody[i][0], melody[i][1], MIDI_VOL_HALF, TRUE, FALSE);
+			midiTrackAddNote(mf, 1, MIDI_OCTAVE_4+melody[i][0], melody[i][1], MIDI_VOL_HALF, true, false);
 			/* Since MIDI notes are just integers, we could add 'MIDI_OCTAVE_4+1'
 			** here to transpose it very simply into Bb Maj 
 			*/
@@ -131,9 +131,9 @@ int i;
 		*/
 		for(i=0;i<sizeof(chords)/sizeof(chords[0]);i++)
 			{
-			midiTrackAddNote(mf, 2, chords[i][0], MIDI_NOTE_MINIM, MIDI_VOL_HALF, FALSE, FALSE);
-			midiTrackAddNote(mf, 2, chords[i][1], MIDI_NOTE_MINIM, MIDI_VOL_HALF, FALSE, FALSE);
-			midiTrackAddNote(mf, 2, chords[i][2], MIDI_NOTE_MINIM, MIDI_VOL_HALF, TRUE, FALSE);
+			midiTrackAddNote(mf, 2, chords[i][0], MIDI_NOTE_MINIM, MIDI_VOL_HALF, false, false);
+			midiTrackAddNote(mf, 2, chords[i][1], MIDI_NOTE_MINIM, MIDI_VOL_HALF, false, false);
+			midiTrackAddNote(mf, 2, chords[i][2], MIDI_NOTE_MINIM, MIDI_VOL_HALF, true, false);
 			}
 
 		/* Write a (dull) drum track */
@@ -144,12 +144,12 @@ int i;
 			if (i==0 || i==4)	/* create accents on first beat */
 				vol = MIDI_VOL_HALF+30;
 
-			midiTrackAddNote(mf, 3, MIDI_DRUM_BASS_DRUM, MIDI_NOTE_CROCHET, vol, FALSE, FALSE);
+			midiTrackAddNote(mf, 3, MIDI_DRUM_BASS_DRUM, MIDI_NOTE_CROCHET, vol, false, false);
 			if (i&1)	/* every other beat */
-				midiTrackAddNote(mf, 3, MIDI_DRUM_ELECTRIC_SNARE, MIDI_NOTE_CROCHET, vol, FALSE, FALSE);
+				midiTrackAddNote(mf, 3, MIDI_DRUM_ELECTRIC_SNARE, MIDI_NOTE_CROCHET, vol, false, false);
 			
 			/* explicitly move play ptr on */
-			midiTrackIncTime(mf, 3, MIDI_NOTE_CROCHET, FALSE);
+			midiTrackIncTime(mf, 3, MIDI_NOTE_CROCHET, false);
 			}
 
 		midiFileClose(mf);
@@ -177,13 +177,12 @@ MIDI_FILE *mf = midiFileOpen(pFilename);
 			while(midiReadGetNextMessage(mf, i, &msg))
 				{
 				printf("\t");
-				for(j=0;j<msg.iMsgSize;j++)
-					printf("%.2x ", msg.data[j]);
+				for(j=0;j<msg.data_sz_embedded;j++)
+					printf("%.2x ", msg.dataEmbedded[j]);
 				printf("\n");
 				}
 			}
 
-		midiReadFreeMessage(&msg);
 		midiFileClose(mf);
 		}
 }
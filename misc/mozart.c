@@ -28,6 +28,27 @@
 #include "midifile.h"
 #include "mozart.h"
 
+/* Copies a message, which was read from a file. Messages in running status come without
+** their status byte, and long meta events/SysEx don't fit into the message buffer.
+*/
+static bool copyMsg(MIDI_FILE *mf, int iTrack, const MIDI_MSG *pMsg, int dt)
+{
+uint8_t data[3];
+
+	if (pMsg->bImpliedMsg)
+		{
+		data[0] = (uint8_t)(pMsg->iType | (pMsg->iLastMsgChnl-1));
+		memcpy(&data[1], pMsg->dataEmbedded, pMsg->iMsgSize);
+		return midiTrackAddRaw(mf, iTrack, pMsg->iMsgSize+1, data, true, dt);
+		}
+	if (pMsg->data_sz_embedded < pMsg->iMsgFullSize)	/* truncated */
+		{
+		midiTrackIncTime(mf, iTrack, dt, true);
+		return false;
+		}
+	return midiTrackAddRaw(mf, iTrack, pMsg->iMsgSize, pMsg->dataEmbedded, true, dt);
+}
+
 /*
 ** Data Tables
 */
@@ -87,15 +108,15 @@ int i, n, r;
 }
 
 
-static BOOL mozartFileConcat(MIDI_FILE *mf, const char *fn, DWORD *last_bar_end)
+static bool mozartFileConcat(MIDI_FILE *mf, const char *fn, uint32_t *last_bar_end)
 {
 MIDI_FILE *mif;
 MIDI_MSG msg;
-BOOL first=TRUE;
-DWORD dt=0, last_pos=0;
+bool first=true;
+uint32_t dt=0, last_pos=0;
 int notes_up=0, notes_down=0;
-BYTE notes[128];
-DWORD end_of_last_midi_pos;
+uint8_t notes[128];
+uint32_t end_of_last_midi_pos;
 
 	midiReadInitMessage(&msg);
 	memset(notes, '\0', sizeof(notes));
@@ -111,7 +132,7 @@ DWORD end_of_last_midi_pos;
 				/* Does the first note start exactly at the start of the bar, or a little bit
 				** afterward? Whatever it is, we must maintain it.
 				*/
-				if (msg.dt > (DWORD)midiFileGetPPQN(mif)*3)
+				if (msg.dt > (uint32_t)midiFileGetPPQN(mif)*3)
 					dt = msg.dt - midiFileGetPPQN(mif)*3;		/* we know (in this case) that the first bar (or 3 three beats) is empty */
 				else
 					dt = 0;
@@ -119,7 +140,7 @@ DWORD end_of_last_midi_pos;
 				if (end_of_last_midi_pos < *last_bar_end)
 					dt += *last_bar_end-end_of_last_midi_pos;
 				
-				first = FALSE;
+				first = false;
 				}
 			else
 				{
@@ -141,23 +162,23 @@ DWORD end_of_last_midi_pos;
 			else if (msg.iType == msgMetaEvent && msg.MsgData.MetaEvent.iType == metaEndSequence)
 				;
 			else
-				midiTrackAddRaw(mf, 1, msg.iMsgSize, msg.data, TRUE, (dt*midiFileGetPPQN(mf))/midiFileGetPPQN(mif));
+				copyMsg(mf, 1, &msg, (dt*midiFileGetPPQN(mf))/midiFileGetPPQN(mif));
 			
 			last_pos = msg.dwAbsPos;
 			}
 		
 		(*last_bar_end) += midiFileGetPPQN(mif)*3;
+		midiFileClose(mif);
 		}
-	midiReadFreeMessage(&msg);
 	
-	return TRUE;
+	return true;
 }
 
-BOOL mozartCreateMidi(const char *pFilename, MOZART_TABLE *pTable, MOZART_PREFS *prefs, BOOL bOverwrite)
+bool mozartCreateMidi(const char *pFilename, MOZART_TABLE *pTable, MOZART_PREFS *prefs, bool bOverwrite)
 {
 MIDI_FILE *mf;
 char str[128];
-DWORD last_bar_pos = 0;
+uint32_t last_bar_pos = 0;
 int i, part;
 	
 	if ((mf = midiFileCreate(pFilename, bOverwrite)))
@@ -178,7 +199,7 @@ int i, part;
 		midiFileClose(mf);
 		}
 	
-	return mf?TRUE:FALSE;
+	return mf?true:false;
 }
 
 void mozartInit(void)
@@ -52,7 +52,7 @@ extern MOZART_TABLE g_mMinuet, g_mTrio;
 */
 void mozartInit(void);
 void mozartRandomize(MOZART_PREFS *prefs, const MOZART_TABLE *pTable);
-BOOL mozartCreateMidi(const char *pFilename, MOZART_TABLE *pTable, MOZART_PREFS *prefs, BOOL bOverwrite);
+bool mozartCreateMidi(const char *pFilename, MOZART_TABLE *pTable, MOZART_PREFS *prefs, bool bOverwrite);
 
 
 #endif	/* _MOZART_DICE_H */
@@ -41,10 +41,10 @@ int main(int argc, char* argv[])
 	mozartInit();
 
 	mozartRandomize(&mozRules, &g_mMinuet);
-	mozartCreateMidi("mozart-minuet.mid", &g_mMinuet, &mozRules, TRUE);
+	mozartCreateMidi("mozart-minuet.mid", &g_mMinuet, &mozRules, true);
 	
 	mozartRandomize(&mozRules, &g_mTrio);
-	mozartCreateMidi("mozart-trio.mid", &g_mTrio, &mozRules, TRUE);
+	mozartCreateMidi("mozart-trio.mid", &g_mTrio, &mozRules, true);
 
 	return 0;
 }